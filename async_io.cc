@@ -0,0 +1,277 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   Pipelined I/O. A thread reads (or writes) the file in blocks while the
+   coder works on the previous (or next) ones, so that the waits for the
+   disk or network file system overlap with the coding. At most
+   'num_blocks' blocks are in flight, bounding the memory used.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "lzip.h"
+#include "common_mutex.h"
+
+
+struct Block_queue
+  {
+  enum { block_size = 1 << 18, num_blocks = 4 };
+  struct Block
+    {
+    uint8_t * data;
+    int size;
+    Block( uint8_t * const d, const int s ) : data( d ), size( s ) {}
+    };
+
+  std::deque< Block > full;		// blocks waiting to be consumed
+  std::vector< uint8_t * > empty;	// blocks waiting to be filled
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;	// a block was moved, or flags changed
+  pthread_t thread;
+  const int fd;
+  const bool sparse;		// write with writeblock_sparse
+  int error;			// errno of the thread's failed I/O, or 0
+  bool finished;		// no more full blocks will be queued
+  bool stop;			// the thread must exit as soon as possible
+
+  explicit Block_queue( const int ifd, const bool sp = false )
+    : fd( ifd ), sparse( sp ), error( 0 ), finished( false ), stop( false )
+    {
+    for( int i = 0; i < num_blocks; ++i )
+      {
+      uint8_t * const p = new( std::nothrow ) uint8_t[block_size];
+      if( !p ) { free_blocks(); throw std::bad_alloc(); }
+      empty.push_back( p );
+      }
+    xinit_mutex( &mutex ); xinit_cond( &changed );
+    }
+
+  ~Block_queue()
+    { free_blocks(); xdestroy_cond( &changed ); xdestroy_mutex( &mutex ); }
+
+  void free_blocks()
+    {
+    for( unsigned i = 0; i < empty.size(); ++i ) delete[] empty[i];
+    for( unsigned i = 0; i < full.size(); ++i ) delete[] full[i].data;
+    empty.clear(); full.clear();
+    }
+
+  /* Wait for a full block (if from_full) or for an empty one. Return 0
+     if stopped, or if finished and no full blocks remain. */
+  uint8_t * take( const bool from_full, int * const size = 0 )
+    {
+    uint8_t * p = 0;
+    xlock( &mutex );
+    if( from_full )
+      {
+      while( full.empty() && !finished && !stop ) xwait( &changed, &mutex );
+      if( !stop && !full.empty() )
+        { p = full.front().data; *size = full.front().size; full.pop_front();
+          xbroadcast( &changed ); }
+      }
+    else
+      {
+      while( empty.empty() && !stop ) xwait( &changed, &mutex );
+      if( !stop ) { p = empty.back(); empty.pop_back(); }
+      }
+    xunlock( &mutex );
+    return p;
+    }
+
+  void give( uint8_t * const p, const bool to_full, const int size = 0 )
+    {
+    xlock( &mutex );
+    if( to_full ) full.push_back( Block( p, size ) ); else empty.push_back( p );
+    xbroadcast( &changed );
+    xunlock( &mutex );
+    }
+
+  void set_flags( const bool fin, const bool stp, const int err = 0 )
+    {
+    xlock( &mutex );
+    if( fin ) finished = true;
+    if( stp ) stop = true;
+    if( err && !error ) error = err;
+    xbroadcast( &changed );
+    xunlock( &mutex );
+    }
+
+  int get_error()
+    { xlock( &mutex ); const int e = error; xunlock( &mutex ); return e; }
+
+  bool stopped()
+    { xlock( &mutex ); const bool s = stop; xunlock( &mutex ); return s; }
+
+  void start( void * (*routine)( void * ) )
+    {
+    const int errcode = pthread_create( &thread, 0, routine, this );
+    if( errcode )
+      { show_error( "Can't create I/O thread", errcode ); cleanup_and_fail( 1 ); }
+    }
+
+  void join()
+    {
+    const int errcode = pthread_join( thread, 0 );
+    if( errcode )
+      { show_error( "Can't join I/O thread", errcode ); cleanup_and_fail( 1 ); }
+    }
+
+  /* Stop the thread, wait for it to exit, and delete the queue, so that
+     fd is no longer used when the caller closes it. A reader blocked on a
+     pipe exits as soon as its current read returns. */
+  void release()
+    { set_flags( false, true ); join(); delete this; }
+  };
+
+
+namespace {
+
+/* Fill empty blocks from fd until EOF or error. Like readblock, but
+   checking between reads whether the thread has been stopped. */
+extern "C" void * reader( void * arg )
+  {
+  Block_queue & q = *(Block_queue *)arg;
+  while( true )
+    {
+    uint8_t * const p = q.take( false );
+    if( !p ) break;					// stopped
+    int rd = 0;
+    errno = 0;
+    while( rd < q.block_size && !q.stopped() )
+      {
+      const int n = read( q.fd, p + rd, q.block_size - rd );
+      if( n > 0 ) rd += n;
+      else if( n == 0 ) break;				// EOF
+      else if( errno != EINTR ) break;
+      errno = 0;
+      }
+    const int err = ( rd < q.block_size ) ? errno : 0;
+    q.give( p, true, rd );
+    if( rd < q.block_size ) { q.set_flags( true, false, err ); break; }
+    }
+  return 0;
+  }
+
+
+// write full blocks to fd until finished; after an error, discard them
+extern "C" void * writer( void * arg )
+  {
+  Block_queue & q = *(Block_queue *)arg;
+  while( true )
+    {
+    int size = 0;
+    uint8_t * const p = q.take( true, &size );
+    if( !p ) break;				// finished and drained, or stopped
+    const int wr = ( q.get_error() != 0 ) ? size : q.sparse ?
+      writeblock_sparse( q.fd, p, size ) : writeblock( q.fd, p, size );
+    if( wr != size )
+      q.set_flags( false, false, errno ? errno : EIO );
+    q.give( p, false );
+    }
+  return 0;
+  }
+
+} // end namespace
+
+
+Async_source::~Async_source()
+  {
+  if( !queue ) return;
+  if( block ) queue->give( block, false );
+  queue->release();
+  }
+
+
+int Async_source::read( uint8_t * const buf, const int size )
+  {
+  if( !queue )
+    { queue = new Block_queue( fd ); queue->start( reader ); }
+  int sz = 0;
+  while( sz < size )
+    {
+    if( block_pos >= bsize )			// current block used
+      {
+      if( block ) { queue->give( block, false ); block = 0; }
+      if( at_end ) break;
+      block = queue->take( true, &bsize );
+      block_pos = 0;
+      if( !block ) { bsize = 0; at_end = true; break; }
+      if( bsize < Block_queue::block_size ) at_end = true;
+      continue;
+      }
+    const int n = std::min( size - sz, bsize - block_pos );
+    std::memcpy( buf + sz, block + block_pos, n );
+    block_pos += n; sz += n;
+    }
+  errno = ( sz < size ) ? queue->get_error() : 0;
+  return sz;
+  }
+
+
+Async_sink::~Async_sink()		// not flushed; discard pending data
+  {
+  if( !queue ) return;
+  if( block ) queue->give( block, false );
+  queue->release();
+  }
+
+
+int Async_sink::write( const uint8_t * const buf, const int size )
+  {
+  if( fd < 0 ) return size;				// discard data
+  if( !queue )
+    { queue = new Block_queue( fd, sparse ); queue->start( writer ); }
+  int sz = 0;
+  while( sz < size )
+    {
+    if( !block ) { block = queue->take( false ); block_pos = 0; }
+    const int err = queue->get_error();
+    if( err ) { errno = err; break; }
+    const int n = std::min( size - sz, Block_queue::block_size - block_pos );
+    std::memcpy( block + block_pos, buf + sz, n );
+    block_pos += n; sz += n;
+    if( block_pos >= Block_queue::block_size )
+      { queue->give( block, true, block_pos ); block = 0; }
+    }
+  return sz;
+  }
+
+
+bool Async_sink::flush()
+  {
+  if( !queue ) return true;
+  if( block && block_pos > 0 )
+    { queue->give( block, true, block_pos ); block = 0; }
+  queue->set_flags( true, false );
+  queue->join();
+  const int err = queue->get_error();
+  if( block ) queue->give( block, false );
+  delete queue; queue = 0; block = 0;
+  errno = err;
+  return err == 0;
+  }
@@ -0,0 +1,241 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lzip.h"
+
+
+namespace {
+
+// each measurement is repeated until it has taken at least this CPU time
+const double min_time = 0.5;		// seconds
+
+double cpu_time()
+  { return (double)std::clock() / CLOCKS_PER_SEC; }
+
+
+bool read_file( const int infd, std::vector< uint8_t > & data )
+  {
+  enum { block_size = 1 << 20 };
+  while( true )
+    {
+    const unsigned long old_size = data.size();
+    data.resize( old_size + block_size );
+    const int rd = readblock( infd, &data[old_size], block_size );
+    data.resize( old_size + rd );
+    if( rd < block_size ) return errno == 0;
+    }
+  }
+
+
+/* If tsv, print one line of tab-separated fields per level, prefixed by
+   name, instead of a table. The sizes are exact so that the results of
+   different versions can be compared. The levels of '--fast=<n>' follow
+   -9, so that the lines of -0 to -9 keep their place. */
+void bench_data( const std::vector< uint8_t > & data, const char * const name,
+                 const Lzma_options option_mapping[],
+                 const Lzma_options fast_mapping[],
+                 const unsigned long long member_size, const bool tsv )
+  {
+  std::vector< uint8_t > out;
+  if( !tsv ) std::printf( "     level  comp MB/s  decomp MB/s   ratio   saved"
+                          "   comp mem  decomp mem\n" );
+  for( int level = 0; level <= 12; ++level )	// 10-12 = --fast=1..3
+    {
+    const bool fast = level > 9;
+    const Lzma_options & options =
+      fast ? fast_mapping[level-10] : option_mapping[level];
+    char label[16];
+    if( fast ) snprintf( label, sizeof label, "fast=%d", level - 9 );
+    else snprintf( label, sizeof label, "%d", level );
+    unsigned long long cmem = 0;
+    int runs = 0;
+    double start = cpu_time(), ctime;
+    do {
+      out.clear();
+      Mem_source isrc( data.empty() ? 0 : &data[0], data.size() );
+      Mem_sink osnk( out );
+      if( compress_data( isrc, osnk, options, member_size, level == 0,
+                         &cmem ) != 0 )
+        internal_error( "encoder error in benchmark." );
+      ++runs;
+      } while( ( ctime = cpu_time() - start ) < min_time );
+    const double cspeed = ( data.size() * (double)runs ) / ctime / 1e6;
+    std::vector< uint8_t > check;		// verify the round trip once
+    if( decompress_buffer( &out[0], out.size(), check ) != 0 || check != data )
+      internal_error( "benchmark data don't match after decompression." );
+
+    unsigned dmem = 0;
+    runs = 0; start = cpu_time();
+    double dtime;
+    do {
+      Mem_source isrc( &out[0], out.size() );
+      Fd_sink osnk( -1 );			// discard data
+      if( decompress_data( isrc, osnk, &dmem ) != 0 )
+        internal_error( "decoder error in benchmark." );
+      ++runs;
+      } while( ( dtime = cpu_time() - start ) < min_time );
+    const double dspeed = ( data.size() * (double)runs ) / dtime / 1e6;
+
+    if( tsv )
+      {
+      std::printf( "%s\t%lu\t%s\t%lu\t%.2f\t%.2f\t%llu\t%u\n", name,
+                   (unsigned long)data.size(), label, (unsigned long)out.size(),
+                   cspeed, dspeed, cmem, dmem );
+      std::fflush( stdout ); continue;
+      }
+    std::printf( "%*s%s  %9.2f  %11.2f", fast ? 4 : 9, fast ? "--" : "-",
+                 label, cspeed, dspeed );
+    if( data.size() > 0 )
+      std::printf( "  %6.3f  %5.2f%%", (double)data.size() / out.size(),
+                   100.0 - ( ( 100.0 * out.size() ) / data.size() ) );
+    else std::fputs( "       -     -  ", stdout );
+    std::printf( "  %s", format_ds( std::min( cmem, 0xFFFFFFFFULL ) ) );
+    std::printf( "   %s\n", format_ds( dmem ) );
+    std::fflush( stdout );
+    }
+  }
+
+
+/* Return the compression speed of level on data, multiplied by the number
+   of threads that would be used. Store the compression ratio in *ratiop.
+   The sample is split in members of member_size bytes, as the file would
+   be. */
+double sample_speed( const uint8_t * const data, const long size,
+                     const Lzma_options option_mapping[], const int level,
+                     const int num_workers,
+                     const unsigned long long file_size,
+                     const unsigned long long member_size,
+                     double * const ratiop = 0 )
+  {
+  // fast levels are repeated until they have taken at least this CPU time
+  const double min_sample_time = 0.05;		// seconds
+  std::vector< uint8_t > out;
+  int runs = 0;
+  const double start = cpu_time();
+  double ctime;
+  do {
+    out.clear();
+    if( compress_buffer( data, size, out, option_mapping[level], member_size,
+                         level == 0 ) != 0 )
+      internal_error( "encoder error in sample." );
+    ++runs;
+    } while( ( ctime = cpu_time() - start ) < min_sample_time );
+  const int data_size = ( level == 0 ) ? 1 << 20 :
+                        2 * option_mapping[level].dictionary_size;
+  const unsigned long long blocks = ( file_size > 0 ) ?
+    ( file_size + data_size - 1 ) / data_size : num_workers;
+  const int workers = std::min( (unsigned long long)num_workers, blocks );
+  const double speed = ( size * (double)runs ) / ctime / 1e6 * workers;
+  const double ratio = (double)size / out.size();
+  if( verbosity >= 3 )
+    std::fprintf( stderr, "  sample at -%d: %.2f MB/s, %.3f:1\n",
+                  level, speed, ratio );
+  if( ratiop ) *ratiop = ratio;
+  return speed;
+  }
+
+} // end namespace
+
+
+/* Compress a sample of the input and return the slowest level that
+   compresses at least target.speed MB/s (or level 0) if target.speed > 0,
+   else the fastest level that reaches target.ratio (or level 9). The
+   speed of the levels that would use several threads for a file of
+   file_size bytes (0 = unknown) is multiplied by the number of threads.
+   As speed decreases and ratio increases with the level, the levels are
+   tried in order for speed, and by bisection for ratio.
+   Return -1 if the sample is empty. */
+int auto_level( const uint8_t * const data, const long size,
+                const Lzma_options option_mapping[],
+                const Auto_target & target, const int num_workers,
+                const unsigned long long file_size,
+                const unsigned long long member_size )
+  {
+  if( size <= 0 ) return -1;
+  if( target.speed > 0 )
+    {
+    int level = 0;
+    while( level < 9 && sample_speed( data, size, option_mapping, level + 1,
+                         num_workers, file_size, member_size ) >= target.speed )
+      ++level;
+    return level;
+    }
+  int low = 0, high = 9;		// ratio( high ) is assumed to be enough
+  while( low < high )
+    {
+    const int level = ( low + high ) / 2;
+    double ratio;
+    sample_speed( data, size, option_mapping, level, num_workers, file_size,
+                  member_size, &ratio );
+    if( ratio >= target.ratio ) high = level; else low = level + 1;
+    }
+  return low;
+  }
+
+
+/* Load each file in memory and measure the speed of compression and
+   decompression at every level, excluding the I/O. */
+int bench_files( const std::vector< std::string > & filenames,
+                 const Lzma_options option_mapping[],
+                 const Lzma_options fast_mapping[],
+                 const unsigned long long member_size, const bool tsv )
+  {
+  int retval = 0;
+  bool stdin_used = false;
+
+  if( tsv && verbosity >= 0 )
+    std::fputs( "#file\tsize\tlevel\tcsize\tcomp_MB/s\tdecomp_MB/s"
+                "\tcomp_mem\tdecomp_mem\n", stdout );
+  for( unsigned i = 0; i < filenames.size(); ++i )
+    {
+    const bool from_stdin = filenames[i] == "-";
+    if( from_stdin ) { if( stdin_used ) continue; else stdin_used = true; }
+    const char * const input_filename =
+      from_stdin ? "(stdin)" : filenames[i].c_str();
+    struct stat in_stats;				// not used
+    const int infd = from_stdin ? STDIN_FILENO :
+      open_instream( input_filename, &in_stats, false );
+    if( infd < 0 ) { set_retval( retval, 1 ); continue; }
+
+    std::vector< uint8_t > data;
+    const bool ok = read_file( infd, data );
+    const int saved_errno = errno;
+    close( infd );
+    if( !ok )
+      { show_file_error( input_filename, "Read error", saved_errno );
+        set_retval( retval, 1 ); continue; }
+    if( verbosity < 0 ) continue;
+    if( !tsv ) std::printf( "%s%s: %lu bytes\n", ( i > 0 ) ? "\n" : "",
+                            input_filename, (unsigned long)data.size() );
+    bench_data( data, input_filename, option_mapping, fast_mapping,
+                member_size, tsv );
+    }
+  return retval;
+  }
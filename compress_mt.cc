@@ -0,0 +1,294 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "lzip.h"
+#include "common_mutex.h"
+
+
+namespace {
+
+struct Packet			// data block to be compressed by one worker
+  {
+  uint8_t * data;		// uncompressed data, freed by the worker
+  int size;			// number of bytes in data
+  std::vector< uint8_t > out;	// compressed members
+  Packet( uint8_t * const d, const int s ) : data( d ), size( s ) {}
+  };
+
+
+/* Packet i is given to worker (i % num_workers) and collected from it in
+   the same order, so members are written in the order of their data. */
+class Packet_courier			// moves packets around
+  {
+  std::vector< std::deque< Packet * > > ipackets;	// one per worker
+  std::vector< std::deque< Packet * > > opackets;	// one per worker
+  unsigned long delivered;	// number of packets sent to workers
+  int in_flight;		// packets delivered but not yet collected
+  const int num_slots;		// max in_flight
+  pthread_mutex_t mutex;
+  pthread_cond_t iav_or_eof;	// input packet available or splitter done
+  pthread_cond_t oav;		// output packet available
+  pthread_cond_t slot_av;	// free slot available
+  bool eof;			// splitter done
+
+  Packet_courier( const Packet_courier & );	// declared as private
+  void operator=( const Packet_courier & );	// declared as private
+
+public:
+  Packet_courier( const int num_workers, const int slots )
+    : ipackets( num_workers ), opackets( num_workers ), delivered( 0 ),
+      in_flight( 0 ), num_slots( slots ), eof( false )
+    {
+    xinit_mutex( &mutex ); xinit_cond( &iav_or_eof );
+    xinit_cond( &oav ); xinit_cond( &slot_av );
+    }
+
+  ~Packet_courier()
+    {
+    xdestroy_cond( &slot_av ); xdestroy_cond( &oav );
+    xdestroy_cond( &iav_or_eof ); xdestroy_mutex( &mutex );
+    }
+
+  // splitter delivers a packet to the next worker; waits for a free slot
+  void deliver_packet( Packet * const packet )
+    {
+    xlock( &mutex );
+    while( in_flight >= num_slots ) xwait( &slot_av, &mutex );
+    ipackets[delivered++ % ipackets.size()].push_back( packet );
+    ++in_flight;
+    xbroadcast( &iav_or_eof );
+    xunlock( &mutex );
+    }
+
+  void finish()				// splitter has no more packets
+    {
+    xlock( &mutex );
+    eof = true;
+    xbroadcast( &iav_or_eof );
+    xsignal( &oav );
+    xunlock( &mutex );
+    }
+
+  // worker receives its next packet; returns 0 if no more packets
+  Packet * receive_packet( const int worker_id )
+    {
+    Packet * packet = 0;
+    xlock( &mutex );
+    std::deque< Packet * > & q = ipackets[worker_id];
+    while( q.empty() && !eof ) xwait( &iav_or_eof, &mutex );
+    if( !q.empty() ) { packet = q.front(); q.pop_front(); }
+    xunlock( &mutex );
+    return packet;
+    }
+
+  void collect_packet( const int worker_id, Packet * const packet )
+    {
+    xlock( &mutex );
+    opackets[worker_id].push_back( packet );
+    xsignal( &oav );
+    xunlock( &mutex );
+    }
+
+  // muxer takes packet number i; returns 0 if no more packets
+  Packet * deliver_output( const unsigned long i )
+    {
+    Packet * packet = 0;
+    xlock( &mutex );
+    std::deque< Packet * > & q = opackets[i % opackets.size()];
+    while( q.empty() && !( eof && i >= delivered ) ) xwait( &oav, &mutex );
+    if( !q.empty() )
+      {
+      packet = q.front(); q.pop_front();
+      --in_flight;
+      xsignal( &slot_av );
+      }
+    xunlock( &mutex );
+    return packet;
+    }
+  };
+
+
+struct Splitter_arg
+  {
+  Packet_courier * courier;
+  const Pretty_print * pp;
+  Data_source * src;
+  int data_size;
+  };
+
+
+// read data in blocks of 'data_size' bytes and deliver them to the workers
+extern "C" void * csplitter( void * arg )
+  {
+  const Splitter_arg & tmp = *(const Splitter_arg *)arg;
+  Packet_courier & courier = *tmp.courier;
+  const Pretty_print & pp = *tmp.pp;
+  Data_source & src = *tmp.src;
+  const int data_size = tmp.data_size;
+
+  for( bool first_post = true; ; first_post = false )
+    {
+    uint8_t * const data = new( std::nothrow ) uint8_t[data_size];
+    if( !data ) { pp( "Not enough memory." ); cleanup_and_fail( 1 ); }
+    const int size = src.read( data, data_size );
+    if( size != data_size && errno )
+      { pp(); show_error( "Read error", errno ); cleanup_and_fail( 1 ); }
+    // an empty file is compressed to one empty member
+    if( size > 0 || first_post ) courier.deliver_packet( new Packet( data, size ) );
+    else delete[] data;
+    if( size < data_size ) break;
+    }
+  courier.finish();
+  return 0;
+  }
+
+
+struct Worker_arg
+  {
+  Packet_courier * courier;
+  const Pretty_print * pp;
+  unsigned long long member_size;
+  Lzma_options options;
+  int worker_id;
+  bool zero;
+  };
+
+
+// compress each packet into one or more members of size <= member_size
+extern "C" void * cworker( void * arg )
+  {
+  const Worker_arg & tmp = *(const Worker_arg *)arg;
+  Packet_courier & courier = *tmp.courier;
+  const Pretty_print & pp = *tmp.pp;
+  Encoder_pool pool;			// reuse the encoder for every packet
+
+  while( true )
+    {
+    Packet * const packet = courier.receive_packet( tmp.worker_id );
+    if( !packet ) break;
+    try {
+      Mem_source isrc( packet->data, packet->size );
+      Mem_sink osnk( packet->out );
+      if( compress_data( isrc, osnk, tmp.options, tmp.member_size,
+                         tmp.zero, 0, &pool ) != 0 )
+        { pp( "Encoder error." ); cleanup_and_fail( 1 ); }
+      }
+    catch( std::bad_alloc & )
+      { pp( "Not enough memory. Try a smaller dictionary size." );
+        cleanup_and_fail( 1 ); }
+    delete[] packet->data; packet->data = 0;
+    courier.collect_packet( tmp.worker_id, packet );
+    }
+  return 0;
+  }
+
+} // end namespace
+
+
+/* Return the bytes used by compress_mt with num_workers workers; the
+   encoders, and the blocks of data_size bytes in flight (two per worker,
+   uncompressed or compressed, and one being read by the splitter). */
+unsigned long long compress_mt_memory( const int data_size,
+                                       const Lzma_options & options,
+                                       const int num_workers, const bool zero )
+  {
+  return num_workers * ( encoder_memory( options, zero ) + 2ULL * data_size ) +
+         data_size;
+  }
+
+
+/* Split the input in blocks of 'data_size' bytes, compress them in
+   parallel, and write the resulting members in order. */
+int compress_mt( const unsigned long long cfile_size,
+                 const unsigned long long member_size, const int data_size,
+                 const Lzma_options & options, const int num_workers,
+                 Data_source & src, const int outfd,
+                 const Pretty_print & pp, const bool zero,
+                 unsigned long long & in_size, unsigned long long & out_size )
+  {
+  Packet_courier courier( num_workers, 2 * num_workers );
+
+  Splitter_arg splitter_arg;
+  splitter_arg.courier = &courier;
+  splitter_arg.pp = &pp;
+  splitter_arg.src = &src;
+  splitter_arg.data_size = data_size;
+
+  pthread_t splitter_thread;
+  int errcode = pthread_create( &splitter_thread, 0, csplitter, &splitter_arg );
+  if( errcode )
+    { show_error( "Can't create splitter thread", errcode ); return 1; }
+
+  std::vector< Worker_arg > worker_args( num_workers );
+  std::vector< pthread_t > worker_threads( num_workers );
+  for( int i = 0; i < num_workers; ++i )
+    {
+    Worker_arg & wa = worker_args[i];
+    wa.courier = &courier;
+    wa.pp = &pp;
+    wa.member_size = member_size;
+    wa.options = options;
+    wa.worker_id = i;
+    wa.zero = zero;
+    errcode = pthread_create( &worker_threads[i], 0, cworker, &wa );
+    if( errcode )
+      { show_error( "Can't create worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+
+  in_size = 0; out_size = 0;
+  for( unsigned long i = 0; ; ++i )		// write packets in order
+    {
+    Packet * const packet = courier.deliver_output( i );
+    if( !packet ) break;
+    const int size = packet->out.size();
+    if( size > 0 && writeblock( outfd, &packet->out[0], size ) != size )
+      { pp(); show_error( wr_err_msg, errno ); cleanup_and_fail( 1 ); }
+    in_size += packet->size;
+    out_size += size;
+    delete packet;
+    show_mt_progress( cfile_size, in_size, out_size, i + 1, true, pp );
+    }
+
+  for( int i = num_workers - 1; i >= 0; --i )
+    {
+    errcode = pthread_join( worker_threads[i], 0 );
+    if( errcode )
+      { show_error( "Can't join worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+  errcode = pthread_join( splitter_thread, 0 );
+  if( errcode )
+    { show_error( "Can't join splitter thread", errcode );
+      cleanup_and_fail( 1 ); }
+  return 0;
+  }
@@ -25,7 +25,12 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#if !defined __MSVCRT__ && !defined __OS2__ && !defined __DJGPP__
+#include <sys/mman.h>
+#endif
 
 #include "lzip.h"
 #include "decoder.h"
@@ -36,16 +41,19 @@
 */
 int readblock( const int fd, uint8_t * const buf, const int size )
   {
+  STATS_TIMER( st_read );
   int sz = 0;
   errno = 0;
   while( sz < size )
     {
     const int n = read( fd, buf + sz, size - sz );
+    STATS( ++stats_timer.syscalls );
     if( n > 0 ) sz += n;
     else if( n == 0 ) break;				// EOF
     else if( errno != EINTR ) break;
     errno = 0;
     }
+  STATS( stats_timer.bytes = sz );
   return sz;
   }
 
@@ -55,25 +63,180 @@ int readblock( const int fd, uint8_t * const buf, const int size )
 */
 int writeblock( const int fd, const uint8_t * const buf, const int size )
   {
+  STATS_TIMER( st_write );
   int sz = 0;
   errno = 0;
   while( sz < size )
     {
     const int n = write( fd, buf + sz, size - sz );
+    STATS( ++stats_timer.syscalls );
     if( n > 0 ) sz += n;
     else if( n < 0 && errno != EINTR ) break;
     errno = 0;
     }
+  STATS( stats_timer.bytes = sz );
   return sz;
   }
 
 
+namespace {
+
+bool is_zero( const uint8_t * const buf, const int size )
+  { return buf[0] == 0 && std::memcmp( buf, buf + 1, size - 1 ) == 0; }
+
+} // end namespace
+
+
+/* Like writeblock, but seek over the blocks of the file that would contain
+   only zeros instead of writing them, leaving holes in the file. fd must be
+   a regular file. As a hole at the end does not extend the file, the file
+   must be truncated to its final size with finish_sparse after the last
+   write. */
+int writeblock_sparse( const int fd, const uint8_t * const buf,
+                       const int size )
+  {
+  enum { block_size = 4096 };		// usual size of a file system block
+  const long long fpos = lseek( fd, 0, SEEK_CUR );
+  if( fpos < 0 ) return writeblock( fd, buf, size );
+  int sz = 0;
+  int bs = block_size - fpos % block_size;	// align blocks to the file
+  while( sz < size )
+    {
+    const bool zero = is_zero( buf + sz, std::min( bs, size - sz ) );
+    int end = sz;		// extend the run of blocks of the same kind
+    while( end < size &&
+           is_zero( buf + end, std::min( bs, size - end ) ) == zero )
+      { end += std::min( bs, size - end ); bs = block_size; }
+    if( !zero )
+      { const int wr = writeblock( fd, buf + sz, end - sz );
+        if( wr != end - sz ) return sz + wr; }
+    else if( lseek( fd, end - sz, SEEK_CUR ) < 0 ) return sz;
+    sz = end;
+    }
+  return sz;
+  }
+
+
+/* Return true if writeblock_sparse can be used on fd; a regular file not
+   opened in append mode. */
+bool sparse_ok( const int fd )
+  {
+  struct stat st;
+  if( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ) return false;
+#ifdef O_APPEND
+  const int flags = fcntl( fd, F_GETFL );
+  if( flags < 0 || ( flags & O_APPEND ) ) return false;
+#endif
+  return true;
+  }
+
+
+// set the size of the file to the current position after writeblock_sparse
+bool finish_sparse( const int fd )
+  {
+  const long long fpos = lseek( fd, 0, SEEK_CUR );
+  return fpos >= 0 && ftruncate( fd, fpos ) == 0;
+  }
+
+
+/* Return the number of bytes really read from position 'pos' of file.
+   If (value returned < size) and (errno == 0), means EOF was reached.
+*/
+int preadblock( const int fd, uint8_t * const buf, const int size,
+                const long long pos )
+  {
+  STATS_TIMER( st_read );
+  int sz = 0;
+  errno = 0;
+  while( sz < size )
+    {
+    const int n = pread( fd, buf + sz, size - sz, pos + sz );
+    STATS( ++stats_timer.syscalls );
+    if( n > 0 ) sz += n;
+    else if( n == 0 ) break;				// EOF
+    else if( errno != EINTR ) break;
+    errno = 0;
+    }
+  STATS( stats_timer.bytes = sz );
+  return sz;
+  }
+
+
+Mmap_source::Mmap_source( const int ifd, const bool map_file )
+  : Fd_source( ifd ), map( 0 ), map_size( 0 ), map_pos( 0 ), offset( 0 ),
+    discarded( 0 ), used( false )
+  {
+#if !defined __MSVCRT__ && !defined __OS2__ && !defined __DJGPP__
+  if( !map_file ) return;
+  struct stat st;
+  if( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ) return;
+  const long long pos = lseek( fd, 0, SEEK_CUR );
+  const long page_size = sysconf( _SC_PAGESIZE );
+  if( pos < 0 || st.st_size <= pos || page_size <= 0 ||
+      st.st_size - pos > max_contents_size ) return;
+  // map only from the page containing pos to the end of the file
+  const long long mpos = pos - pos % page_size;
+  void * const p =
+    mmap( 0, st.st_size - mpos, PROT_READ, MAP_PRIVATE, fd, mpos );
+  if( p == MAP_FAILED ) return;
+  map = (uint8_t *)p; map_size = st.st_size - mpos; map_pos = mpos;
+  offset = pos;
+#ifdef MADV_SEQUENTIAL
+  madvise( map, map_size, MADV_SEQUENTIAL );	// read ahead aggressively
+#endif
+#endif
+  }
+
+
+Mmap_source::~Mmap_source()
+  {
+#if !defined __MSVCRT__ && !defined __OS2__ && !defined __DJGPP__
+  if( map ) munmap( map, map_size );
+#endif
+  }
+
+
+const uint8_t * Mmap_source::contents( int & size )
+  {
+  size = 0;
+  if( !map || used ) return 0;
+  // leave fd positioned at end of data, as if it had been read
+  const long long end = map_pos + map_size;
+  if( lseek( fd, end, SEEK_SET ) != end ) return 0;
+  used = true;
+  size = end - offset;
+  return map + ( offset - map_pos );
+  }
+
+
+void Mmap_source::discard( const uint8_t * const end )
+  {
+#if !defined __MSVCRT__ && !defined __OS2__ && !defined __DJGPP__ && \
+    defined MADV_DONTNEED
+  const long page_size = sysconf( _SC_PAGESIZE );
+  if( !map || page_size <= 0 || end <= map ) return;
+  long long size = std::min( (long long)( end - map ), map_size );
+  size -= size % page_size;
+  if( size <= discarded ) return;
+  // the pages are read again from the file if accessed after this
+  madvise( map + discarded, size - discarded, MADV_DONTNEED );
+  discarded = size;
+#endif
+  }
+
+
 bool Range_decoder::read_block()
   {
   if( !at_stream_end )
     {
-    stream_pos = readblock( infd, buffer, buffer_size );
-    if( stream_pos != buffer_size && errno ) throw Error( "Read error" );
+    if( ibuffer )
+      {
+      stream_pos = isrc.read( ibuffer, buffer_size );
+      if( stream_pos != buffer_size && errno ) throw Error( "Read error" );
+      }
+    else		// move to the next block of data in memory without copying
+      { buffer += pos;
+        stream_pos = std::min( (long)buffer_size, (long)( data_end - buffer ) ); }
     at_stream_end = stream_pos < buffer_size;
     partial_member_pos += pos;
     pos = 0;
@@ -89,7 +252,7 @@ void LZ_decoder::flush_data()
     {
     const int size = pos - stream_pos;
     crc32.update_buf( crc_, buffer + stream_pos, size );
-    if( outfd >= 0 && writeblock( outfd, buffer + stream_pos, size ) != size )
+    if( osnk.write( buffer + stream_pos, size ) != size )
       throw Error( wr_err_msg );
     if( pos >= dictionary_size )
       { partial_data_pos += pos; pos = 0; pos_wrapped = true; }
@@ -98,8 +261,10 @@ void LZ_decoder::flush_data()
   }
 
 
-bool LZ_decoder::check_trailer( const Pretty_print & pp ) const
+bool LZ_decoder::check_trailer( const Pretty_print & pp,
+                                const bool quiet ) const
   {
+  const int verb = quiet ? -1 : verbosity;
   Lzip_trailer trailer;
   int size = rdec.read_data( trailer.data, trailer.size );
   bool error = false;
@@ -107,7 +272,7 @@ bool LZ_decoder::check_trailer( const Pretty_print & pp ) const
   if( size < trailer.size )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( verb >= 0 )
       { pp();
         std::fprintf( stderr, "Trailer truncated at trailer position %d;"
                               " some checks may fail.\n", size ); }
@@ -118,7 +283,7 @@ bool LZ_decoder::check_trailer( const Pretty_print & pp ) const
   if( td_crc != crc() )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( verb >= 0 )
       { pp();
         std::fprintf( stderr, "CRC mismatch; stored %08X, computed %08X\n",
                       td_crc, crc() ); }
@@ -128,7 +293,7 @@ bool LZ_decoder::check_trailer( const Pretty_print & pp ) const
   if( td_size != data_size )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( verb >= 0 )
       { pp();
         std::fprintf( stderr, "Data size mismatch; stored %llu (0x%llX), computed %llu (0x%llX)\n",
                       td_size, td_size, data_size, data_size ); }
@@ -138,15 +303,15 @@ bool LZ_decoder::check_trailer( const Pretty_print & pp ) const
   if( tm_size != member_size )
     {
     error = true;
-    if( verbosity >= 0 )
+    if( verb >= 0 )
       { pp();
         std::fprintf( stderr, "Member size mismatch; stored %llu (0x%llX), computed %llu (0x%llX)\n",
                       tm_size, tm_size, member_size, member_size ); }
     }
   if( error ) return false;
-  if( verbosity >= 2 )
+  if( verb >= 2 )
     {
-    if( verbosity >= 4 ) show_header( dictionary_size );
+    if( verb >= 4 ) show_header( dictionary_size );
     if( data_size == 0 || member_size == 0 )
       std::fputs( "no data compressed. ", stderr );
     else
@@ -154,31 +319,41 @@ bool LZ_decoder::check_trailer( const Pretty_print & pp ) const
                     (double)data_size / member_size,
                     ( 100.0 * member_size ) / data_size,
                     100.0 - ( ( 100.0 * member_size ) / data_size ) );
-    if( verbosity >= 4 ) std::fprintf( stderr, "CRC %08X, ", td_crc );
-    if( verbosity >= 3 )
+    if( verb >= 4 ) std::fprintf( stderr, "CRC %08X, ", td_crc );
+    if( verb >= 3 )
       std::fprintf( stderr, "%9llu out, %8llu in. ", data_size, member_size );
     }
   return true;
   }
 
 
+/* Return value: 0 = EOS marker and valid trailer, 3 = trailer error,
+   4 = unknown marker found. */
+int LZ_decoder::marker_found( const int len, const Pretty_print & pp,
+                              const bool quiet )
+  {
+  rdec.normalize();
+  flush_data();
+  if( len == min_match_len )			// End Of Stream marker
+    return check_trailer( pp, quiet ) ? 0 : 3;
+  if( verbosity >= 0 && !quiet ) { pp();
+    std::fprintf( stderr, "Unsupported marker code '%d'\n", len ); }
+  return 4;
+  }
+
+
 /* Return value: 0 = OK, 1 = decoder error, 2 = unexpected EOF,
                  3 = trailer error, 4 = unknown marker found,
-                 5 = nonzero first LZMA byte found. */
-int LZ_decoder::decode_member( const Pretty_print & pp )
+                 5 = nonzero first LZMA byte found.
+   If quiet, don't print any messages. */
+int LZ_decoder::decode_member( const Pretty_print & pp, const bool quiet )
   {
-  Bit_model bm_literal[1<<literal_context_bits][0x300];
-  Bit_model bm_match[State::states][pos_states];
-  Bit_model bm_rep[State::states];
-  Bit_model bm_rep0[State::states];
-  Bit_model bm_rep1[State::states];
-  Bit_model bm_rep2[State::states];
-  Bit_model bm_len[State::states][pos_states];
-  Bit_model bm_dis_slot[len_states][1<<dis_slot_bits];
-  Bit_model bm_dis[modeled_distances-end_dis_model+1];
-  Bit_model bm_align[dis_align_size];
-  Len_model match_len_model;
-  Len_model rep_len_model;
+  STATS_TIMER( st_decode );
+  Lzma_model model			// reset by its constructor
+#if defined __GNUC__
+    __attribute__(( aligned( 64 ) ))	// start at a cache line
+#endif
+    ;
   unsigned rep0 = 0;		// rep[0-3] latest four distances
   unsigned rep1 = 0;		// used for efficient coding of
   unsigned rep2 = 0;		// repeated distances
@@ -188,11 +363,94 @@ int LZ_decoder::decode_member( const Pretty_print & pp )
   if( !rdec.load() ) return 5;
   while( !rdec.finished() )
     {
+    if( rdec.available_bytes() >= Fast_range_decoder::min_input &&
+        pos + max_match_len + 8 < dictionary_size )
+      {
+      /* Fast loop. Runs while the buffers have room for the longest symbol,
+         so that neither the input nor the output need to be checked. */
+      const unsigned pos_limit = dictionary_size - max_match_len - 8;
+      int marker_len = 0;
+      int result = -1;
+      {
+      Fast_range_decoder frd( rdec );
+      while( frd.enough_input() && pos < pos_limit )
+        {
+        const int pos_state = data_position() & pos_state_mask;
+        if( frd.decode_bit( model.bm_match[state()][pos_state] ) == 0 )
+          {
+          Bit_model * const bm = model.bm_literal[get_lit_state(peek_prev())];
+          if( state.is_char_set_char() )
+            buffer[pos] = frd.decode_tree( bm, 8 );
+          else
+            buffer[pos] = frd.decode_matched( bm, peek( rep0 ) );
+          ++pos; continue;
+          }
+        int len;
+        if( frd.decode_bit( model.bm_rep[state()] ) != 0 )
+          {
+          if( frd.decode_bit( model.bm_rep0[state()] ) == 0 )
+            {
+            if( frd.decode_bit( model.bm_len[state()][pos_state] ) == 0 )
+              { state.set_shortrep(); buffer[pos] = peek( rep0 ); ++pos;
+                continue; }
+            }
+          else
+            {
+            unsigned distance;
+            if( frd.decode_bit( model.bm_rep1[state()] ) == 0 )
+              distance = rep1;
+            else
+              {
+              if( frd.decode_bit( model.bm_rep2[state()] ) == 0 )
+                distance = rep2;
+              else
+                { distance = rep3; rep3 = rep2; }
+              rep2 = rep1;
+              }
+            rep1 = rep0;
+            rep0 = distance;
+            }
+          state.set_rep();
+          len = frd.decode_len( model.rep_len_model, pos_state );
+          }
+        else
+          {
+          rep3 = rep2; rep2 = rep1; rep1 = rep0;
+          len = frd.decode_len( model.match_len_model, pos_state );
+          rep0 = frd.decode_tree( model.bm_dis_slot[get_len_state(len)], 6 );
+          if( rep0 >= start_dis_model )
+            {
+            const unsigned dis_slot = rep0;
+            const int direct_bits = ( dis_slot >> 1 ) - 1;
+            rep0 = ( 2 | ( dis_slot & 1 ) ) << direct_bits;
+            if( dis_slot < end_dis_model )
+              rep0 += frd.decode_tree_reversed(
+                        model.bm_dis + ( rep0 - dis_slot ), direct_bits );
+            else
+              {
+              rep0 +=
+                frd.decode( direct_bits - dis_align_bits ) << dis_align_bits;
+              rep0 +=
+                frd.decode_tree_reversed( model.bm_align, dis_align_bits );
+              if( rep0 == 0xFFFFFFFFU ) { marker_len = len; break; }
+              }
+            }
+          state.set_match();
+          if( rep0 >= dictionary_size || ( rep0 >= pos && !pos_wrapped ) )
+            { result = 1; break; }
+          }
+        copy_block_fast( rep0, len );
+        }
+      }				// the state of frd is copied back to rdec
+      if( marker_len ) return marker_found( marker_len, pp, quiet );
+      if( result >= 0 ) { flush_data(); return result; }
+      continue;
+      }
     const int pos_state = data_position() & pos_state_mask;
-    if( rdec.decode_bit( bm_match[state()][pos_state] ) == 0 )	// 1st bit
+    if( rdec.decode_bit( model.bm_match[state()][pos_state] ) == 0 ) // 1st bit
       {
       // literal byte
-      Bit_model * const bm = bm_literal[get_lit_state(peek_prev())];
+      Bit_model * const bm = model.bm_literal[get_lit_state(peek_prev())];
       if( state.is_char_set_char() )
         put_byte( rdec.decode_tree8( bm ) );
       else
@@ -201,21 +459,21 @@ int LZ_decoder::decode_member( const Pretty_print & pp )
       }
     // match or repeated match
     int len;
-    if( rdec.decode_bit( bm_rep[state()] ) != 0 )		// 2nd bit
+    if( rdec.decode_bit( model.bm_rep[state()] ) != 0 )		// 2nd bit
       {
-      if( rdec.decode_bit( bm_rep0[state()] ) == 0 )		// 3rd bit
+      if( rdec.decode_bit( model.bm_rep0[state()] ) == 0 )	// 3rd bit
         {
-        if( rdec.decode_bit( bm_len[state()][pos_state] ) == 0 ) // 4th bit
+        if( rdec.decode_bit( model.bm_len[state()][pos_state] ) == 0 ) // 4th bit
           { state.set_shortrep(); put_byte( peek( rep0 ) ); continue; }
         }
       else
         {
         unsigned distance;
-        if( rdec.decode_bit( bm_rep1[state()] ) == 0 )		// 4th bit
+        if( rdec.decode_bit( model.bm_rep1[state()] ) == 0 )	// 4th bit
           distance = rep1;
         else
           {
-          if( rdec.decode_bit( bm_rep2[state()] ) == 0 )	// 5th bit
+          if( rdec.decode_bit( model.bm_rep2[state()] ) == 0 )	// 5th bit
             distance = rep2;
           else
             { distance = rep3; rep3 = rep2; }
@@ -225,35 +483,27 @@ int LZ_decoder::decode_member( const Pretty_print & pp )
         rep0 = distance;
         }
       state.set_rep();
-      len = rdec.decode_len( rep_len_model, pos_state );
+      len = rdec.decode_len( model.rep_len_model, pos_state );
       }
     else					// match
       {
       rep3 = rep2; rep2 = rep1; rep1 = rep0;
-      len = rdec.decode_len( match_len_model, pos_state );
-      rep0 = rdec.decode_tree6( bm_dis_slot[get_len_state(len)] );
+      len = rdec.decode_len( model.match_len_model, pos_state );
+      rep0 = rdec.decode_tree6( model.bm_dis_slot[get_len_state(len)] );
       if( rep0 >= start_dis_model )
         {
         const unsigned dis_slot = rep0;
         const int direct_bits = ( dis_slot >> 1 ) - 1;
         rep0 = ( 2 | ( dis_slot & 1 ) ) << direct_bits;
         if( dis_slot < end_dis_model )
-          rep0 += rdec.decode_tree_reversed( bm_dis + ( rep0 - dis_slot ),
+          rep0 += rdec.decode_tree_reversed( model.bm_dis + ( rep0 - dis_slot ),
                                              direct_bits );
         else
           {
           rep0 += rdec.decode( direct_bits - dis_align_bits ) << dis_align_bits;
-          rep0 += rdec.decode_tree_reversed4( bm_align );
+          rep0 += rdec.decode_tree_reversed4( model.bm_align );
           if( rep0 == 0xFFFFFFFFU )		// marker found
-            {
-            rdec.normalize();
-            flush_data();
-            if( len == min_match_len )		// End Of Stream marker
-              { if( check_trailer( pp ) ) return 0; else return 3; }
-            if( verbosity >= 0 ) { pp();
-              std::fprintf( stderr, "Unsupported marker code '%d'\n", len ); }
-            return 4;
-            }
+            return marker_found( len, pp, quiet );
           }
         }
       state.set_match();
@@ -19,35 +19,45 @@ class Range_decoder
   {
   enum { buffer_size = 16384 };
   unsigned long long partial_member_pos;
-  uint8_t * const buffer;	// input buffer
+  uint8_t * ibuffer;		// input buffer, or 0 if data are in memory
+  const uint8_t * buffer;	// ibuffer, or current block of data in memory
+  const uint8_t * data_end;	// end of data in memory
   int pos;			// current pos in buffer
   int stream_pos;		// when reached, a new block must be read
   uint32_t code;
   uint32_t range;
-  const int infd;		// input file descriptor
+  Data_source & isrc;		// source of compressed data
   bool at_stream_end;
 
   bool read_block();
 
   Range_decoder( const Range_decoder & );	// declared as private
   void operator=( const Range_decoder & );	// declared as private
+  friend class Fast_range_decoder;
 
 public:
-  explicit Range_decoder( const int ifd )
+  explicit Range_decoder( Data_source & src )
     :
     partial_member_pos( 0 ),
-    buffer( new uint8_t[buffer_size] ),
+    ibuffer( 0 ),
+    data_end( 0 ),
     pos( 0 ),
     stream_pos( 0 ),
     code( 0 ),
     range( 0xFFFFFFFFU ),
-    infd( ifd ),
+    isrc( src ),
     at_stream_end( false )
-    {}
+    {
+    int size;
+    buffer = isrc.contents( size );	// decode in place if possible
+    if( buffer ) data_end = buffer + size;
+    else buffer = ibuffer = new uint8_t[buffer_size];
+    }
 
-  ~Range_decoder() { delete[] buffer; }
+  ~Range_decoder() { delete[] ibuffer; }
 
   bool finished() { return pos >= stream_pos && !read_block(); }
+  int available_bytes() const { return stream_pos - pos; }
 
   unsigned long long member_position() const
     { return partial_member_pos + pos; }
@@ -257,6 +267,151 @@ len3:
   };
 
 
+/* Works on a copy of the state of a Range_decoder while at least
+   min_input bytes remain in its buffer, which is more than any symbol
+   can consume. Therefore normalize needs not check for the end of the
+   buffer. As the copy is a local object, code and range can be kept in
+   registers. The state is copied back by the destructor. */
+class Fast_range_decoder
+  {
+  Range_decoder & rdec;
+  const uint8_t * p;		// next byte of input
+  const uint8_t * const end;	// end of input in the buffer of rdec
+  uint32_t code;
+  uint32_t range;
+
+  Fast_range_decoder( const Fast_range_decoder & );	// declared as private
+  void operator=( const Fast_range_decoder & );		// declared as private
+
+public:
+  enum { min_input = 64 };	// >= bytes consumed by the longest symbol
+
+  explicit Fast_range_decoder( Range_decoder & rde )
+    : rdec( rde ), p( rde.buffer + rde.pos ),
+      end( rde.buffer + rde.stream_pos ), code( rde.code ),
+      range( rde.range ) {}
+
+  ~Fast_range_decoder()
+    { rdec.pos = p - rdec.buffer; rdec.code = code; rdec.range = range; }
+
+  bool enough_input() const { return end - p >= min_input; }
+
+  void normalize()
+    { if( range <= 0x00FFFFFFU ) { range <<= 8; code = ( code << 8 ) | *p++; } }
+
+  unsigned decode( const int num_bits )
+    {
+    unsigned symbol = 0;
+    for( int i = num_bits; i > 0; --i )
+      {
+      normalize();
+      range >>= 1;
+      const bool bit = code >= range;
+      symbol <<= 1; symbol += bit;
+      code -= range & ( 0U - bit );
+      }
+    return symbol;
+    }
+
+  unsigned decode_bit( Bit_model & bm )
+    {
+    normalize();
+    const uint32_t bound = ( range >> bit_model_total_bits ) * bm.probability;
+    if( code < bound )
+      {
+      range = bound;
+      bm.probability +=
+        ( bit_model_total - bm.probability ) >> bit_model_move_bits;
+      return 0;
+      }
+    code -= bound;
+    range -= bound;
+    bm.probability -= bm.probability >> bit_model_move_bits;
+    return 1;
+    }
+
+  unsigned decode_tree( Bit_model bm[], const int num_bits )
+    {
+    unsigned symbol = 1;
+    for( int i = num_bits; i > 0; --i )
+      symbol = ( symbol << 1 ) | decode_bit( bm[symbol] );
+    return symbol - ( 1U << num_bits );
+    }
+
+  unsigned decode_tree_reversed( Bit_model bm[], const int num_bits )
+    {
+    unsigned model = 1;
+    unsigned symbol = 0;
+    for( int i = 0; i < num_bits; ++i )
+      {
+      const unsigned bit = decode_bit( bm[model] );
+      model = ( model << 1 ) | bit;
+      symbol |= bit << i;
+      }
+    return symbol;
+    }
+
+  /* Like Range_decoder::decode_matched, but without inner loop. Once a bit
+     differs from the bit of match_byte, offs becomes 0 and the rest of the
+     bits are decoded as in a normal literal. */
+  unsigned decode_matched( Bit_model bm[], unsigned match_byte )
+    {
+    unsigned offs = 0x100;
+    unsigned symbol = 1;
+    while( symbol < 0x100 )
+      {
+      match_byte <<= 1;
+      const unsigned match_bit = match_byte & offs;
+      const unsigned bit = decode_bit( bm[offs+match_bit+symbol] );
+      symbol = ( symbol << 1 ) | bit;
+      offs &= bit ? match_bit : ~match_bit;
+      }
+    return symbol & 0xFF;
+    }
+
+  unsigned decode_len( Len_model & lm, const int pos_state )
+    {
+    if( decode_bit( lm.choice1 ) == 0 )
+      return decode_tree( lm.bm_low[pos_state], len_low_bits ) + min_match_len;
+    if( decode_bit( lm.choice2 ) == 0 )
+      return decode_tree( lm.bm_mid[pos_state], len_mid_bits ) +
+             min_match_len + len_low_symbols;
+    return decode_tree( lm.bm_high, len_high_bits ) +
+           min_match_len + len_low_symbols + len_mid_symbols;
+    }
+  };
+
+
+/* Grow-only dictionary buffer, shared by the successive LZ_decoders of one
+   thread so that the dictionary is not allocated and page faulted again
+   for each member of a multimember file, nor for each file. */
+class Dictionary_buffer
+  {
+  uint8_t * data_;
+  unsigned size_;
+
+  Dictionary_buffer( const Dictionary_buffer & );	// declared as private
+  void operator=( const Dictionary_buffer & );		// declared as private
+
+public:
+  Dictionary_buffer() : data_( 0 ), size_( 0 ) {}
+  ~Dictionary_buffer() { large_free( data_, size_ ); }
+
+  // return a buffer of at least size bytes; its contents are undefined
+  uint8_t * get( const unsigned size )
+    {
+    if( size > size_ )
+      {
+      large_free( data_, size_ ); size_ = 0;
+      data_ = (uint8_t *)large_alloc( size );
+      if( !data_ ) throw std::bad_alloc();
+      size_ = size;
+      }
+    return data_;
+    }
+  };
+
+
 class LZ_decoder
   {
   unsigned long long partial_data_pos;
@@ -266,11 +421,13 @@ class LZ_decoder
   unsigned pos;			// current pos in buffer
   unsigned stream_pos;		// first byte not yet written to file
   uint32_t crc_;
-  const int outfd;		// output file descriptor
+  Data_sink & osnk;		// destination of decompressed data
   bool pos_wrapped;
+  const bool own_buffer;	// buffer not taken from a Dictionary_buffer
 
   void flush_data();
-  bool check_trailer( const Pretty_print & pp ) const;
+  bool check_trailer( const Pretty_print & pp, const bool quiet ) const;
+  int marker_found( const int len, const Pretty_print & pp, const bool quiet );
 
   uint8_t peek_prev() const
     { return buffer[((pos > 0) ? pos : dictionary_size)-1]; }
@@ -319,28 +476,60 @@ class LZ_decoder
       }
     }
 
+  /* Like copy_block, but pos + len + 8 must be < dictionary_size. Copies
+     8 bytes at a time if they don't overlap. Before the first wrap the
+     bytes after pos are not yet in the dictionary, so the last 8 bytes
+     copied may extend beyond pos + len. */
+  void copy_block_fast( const unsigned distance, unsigned len )
+    {
+    if( pos <= distance ) { copy_block( distance, len ); return; }
+    uint8_t * dst = buffer + pos;
+    const uint8_t * src = dst - distance - 1;
+    pos += len;
+    if( distance == 0 ) { std::memset( dst, *src, len ); return; }
+    if( distance >= 7 )				// no overlap in 8 bytes
+      {
+      if( !pos_wrapped )
+        {
+        for( unsigned i = 0; i < len; i += 8 )
+          std::memcpy( dst + i, src + i, 8 );
+        return;
+        }
+      for( ; len >= 8; len -= 8, dst += 8, src += 8 )
+        std::memcpy( dst, src, 8 );
+      }
+    for( ; len > 0; --len ) *dst++ = *src++;
+    }
+
   LZ_decoder( const LZ_decoder & );		// declared as private
   void operator=( const LZ_decoder & );		// declared as private
 
 public:
-  LZ_decoder( Range_decoder & rde, const unsigned dict_size, const int ofd )
+  // if dbuf, take the buffer from it instead of allocating a new one
+  LZ_decoder( Range_decoder & rde, const unsigned dict_size, Data_sink & snk,
+              Dictionary_buffer * const dbuf = 0 )
     :
     partial_data_pos( 0 ),
     rdec( rde ),
     dictionary_size( dict_size ),
-    buffer( new uint8_t[dictionary_size] ),
+    buffer( dbuf ? dbuf->get( dictionary_size ) :
+                   (uint8_t *)large_alloc( dictionary_size ) ),
     pos( 0 ),
     stream_pos( 0 ),
     crc_( 0xFFFFFFFFU ),
-    outfd( ofd ),
-    pos_wrapped( false )
+    osnk( snk ),
+    pos_wrapped( false ),
+    own_buffer( !dbuf )
+    {
+    if( !buffer ) throw std::bad_alloc();
     // prev_byte of first byte; also for peek( 0 ) on corrupt file
-    { buffer[dictionary_size-1] = 0; }
+    buffer[dictionary_size-1] = 0;
+    }
 
-  ~LZ_decoder() { delete[] buffer; }
+  ~LZ_decoder() { if( own_buffer ) large_free( buffer, dictionary_size ); }
 
   unsigned crc() const { return crc_ ^ 0xFFFFFFFFU; }
   unsigned long long data_position() const { return partial_data_pos + pos; }
 
-  int decode_member( const Pretty_print & pp );
+  int decode_member( const Pretty_print & pp, const bool quiet = false );
   };
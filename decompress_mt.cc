@@ -0,0 +1,714 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "lzip.h"
+#include "common_mutex.h"
+#include "decoder.h"
+#include "lzip_index.h"
+
+
+namespace {
+
+enum { max_packet_size = 1 << 20, out_slots = 16 };
+
+struct Packet			// data block or end of member
+  {
+  uint8_t * data;		// decompressed data, or 0 if end of member
+  int size;			// bytes in data, or in the member if end
+  int result;			// return value of decode_member
+  unsigned long long dsize;	// decompressed bytes of the member if end
+  Packet( uint8_t * const d, const int s, const int r,
+          const unsigned long long ds = 0 )
+    : data( d ), size( s ), result( r ), dsize( ds ) {}
+  };
+
+
+/* Member i is decoded by worker (i % num_workers). Each worker has its own
+   queue of at most 'out_slots' data packets, which bounds the amount of
+   decompressed data waiting to be written (the reorder window). */
+class Packet_courier			// moves packets around
+  {
+  std::vector< std::deque< Packet * > > opackets;	// one per worker
+  std::vector< pthread_cond_t > slot_av;	// free slot in queue i
+  pthread_mutex_t mutex;
+  pthread_cond_t oav;		// output packet available
+  long first_error_;		// lowest member that failed, or LONG_MAX
+  bool aborted_;		// muxer stopped reading packets
+
+  Packet_courier( const Packet_courier & );	// declared as private
+  void operator=( const Packet_courier & );	// declared as private
+
+public:
+  explicit Packet_courier( const int num_workers )
+    : opackets( num_workers ), slot_av( num_workers ),
+      first_error_( LONG_MAX ), aborted_( false )
+    {
+    xinit_mutex( &mutex ); xinit_cond( &oav );
+    for( int i = 0; i < num_workers; ++i ) xinit_cond( &slot_av[i] );
+    }
+
+  ~Packet_courier()
+    {
+    for( unsigned i = 0; i < opackets.size(); ++i )
+      {
+      while( !opackets[i].empty() )
+        { delete[] opackets[i].front()->data; delete opackets[i].front();
+          opackets[i].pop_front(); }
+      xdestroy_cond( &slot_av[i] );
+      }
+    xdestroy_cond( &oav ); xdestroy_mutex( &mutex );
+    }
+
+  /* worker queues a packet; waits for a free slot if it is a data packet.
+     Returns false (and frees the packet) if the muxer has stopped. */
+  bool collect_packet( const int worker_id, Packet * const packet )
+    {
+    xlock( &mutex );
+    std::deque< Packet * > & q = opackets[worker_id];
+    if( packet->data )
+      while( q.size() >= out_slots && !aborted_ )
+        xwait( &slot_av[worker_id], &mutex );
+    const bool ok = !aborted_;
+    if( ok ) { q.push_back( packet ); xsignal( &oav ); }
+    xunlock( &mutex );
+    if( !ok ) { delete[] packet->data; delete packet; }
+    return ok;
+    }
+
+  // muxer takes the next packet from the queue of worker_id
+  Packet * deliver_packet( const int worker_id )
+    {
+    xlock( &mutex );
+    std::deque< Packet * > & q = opackets[worker_id];
+    while( q.empty() ) xwait( &oav, &mutex );
+    Packet * const packet = q.front(); q.pop_front();
+    xsignal( &slot_av[worker_id] );
+    xunlock( &mutex );
+    return packet;
+    }
+
+  void abort()			// muxer won't read more packets
+    {
+    xlock( &mutex );
+    aborted_ = true;
+    for( unsigned i = 0; i < slot_av.size(); ++i ) xsignal( &slot_av[i] );
+    xunlock( &mutex );
+    }
+
+  bool aborted()
+    { xlock( &mutex ); const bool a = aborted_; xunlock( &mutex ); return a; }
+
+  void set_error( const long member )
+    {
+    xlock( &mutex );
+    if( first_error_ > member ) first_error_ = member;
+    xunlock( &mutex );
+    }
+
+  long first_error()
+    {
+    xlock( &mutex ); const long fe = first_error_; xunlock( &mutex );
+    return fe;
+    }
+  };
+
+
+// split the output of a worker in packets of at most max_packet_size bytes
+class Courier_sink : public Data_sink
+  {
+  Packet_courier & courier;
+  const int worker_id;
+
+public:
+  Courier_sink( Packet_courier & c, const int id )
+    : courier( c ), worker_id( id ) {}
+
+  int write( const uint8_t * const buf, const int size )
+    {
+    for( int pos = 0; pos < size; )
+      {
+      const int sz = std::min( size - pos, (int)max_packet_size );
+      uint8_t * const data = new( std::nothrow ) uint8_t[sz];
+      if( !data ) throw std::bad_alloc();
+      std::memcpy( data, buf + pos, sz );
+      if( !courier.collect_packet( worker_id, new Packet( data, sz, 0 ) ) )
+        { errno = 0; return 0; }	// aborted; makes the decoder stop
+      pos += sz;
+      }
+    return size;
+    }
+  };
+
+
+struct Worker_arg
+  {
+  const Lzip_index * lzip_index;
+  const uint8_t * map;		// contents of the file, or 0 if not mapped
+  Packet_courier * courier;
+  const Pretty_print * pp;
+  int num_workers;
+  int infd;
+  int worker_id;
+  bool testing;
+  };
+
+
+/* Decode members worker_id, worker_id + num_workers, ... quietly. Stop at
+   the first error, or when a member before the next one has failed. */
+extern "C" void * dworker( void * arg )
+  {
+  const Worker_arg & tmp = *(const Worker_arg *)arg;
+  const Lzip_index & lzip_index = *tmp.lzip_index;
+  Packet_courier & courier = *tmp.courier;
+  const Pretty_print & pp = *tmp.pp;
+  Dictionary_buffer dbuf;
+
+  for( long i = tmp.worker_id; i < lzip_index.members(); i += tmp.num_workers )
+    {
+    if( courier.first_error() < i ) break;
+    const Block & mb = lzip_index.mblock( i );
+    int result;
+    try {
+      Pread_source psrc( tmp.infd, mb.pos(), mb.size() );
+      Mem_source msrc( tmp.map ? tmp.map + mb.pos() : 0,
+                       tmp.map ? mb.size() : 0 );
+      Data_source & isrc = tmp.map ? (Data_source &)msrc : (Data_source &)psrc;
+      Range_decoder rdec( isrc );
+      Lzip_header header;	// already checked by Lzip_index
+      rdec.read_data( header.data, header.size );
+      Courier_sink csnk( courier, tmp.worker_id );
+      Fd_sink nsnk( -1 );			// discard data if testing
+      Data_sink & osnk = tmp.testing ? (Data_sink &)nsnk : (Data_sink &)csnk;
+      LZ_decoder decoder( rdec, lzip_index.dictionary_size( i ), osnk,
+                          &dbuf );
+      result = decoder.decode_member( pp, true );
+      }
+    catch( std::bad_alloc & ) { pp( "Not enough memory." ); cleanup_and_fail( 1 ); }
+    catch( Error & e )
+      {
+      if( courier.aborted() ) break;
+      pp(); show_error( e.msg, errno ); cleanup_and_fail( 1 );
+      }
+    if( result != 0 ) courier.set_error( i );
+    if( !tmp.testing &&
+        !courier.collect_packet( tmp.worker_id, new Packet( 0, 0, result ) ) )
+      break;
+    if( result != 0 ) break;
+    }
+  return 0;
+  }
+
+
+struct Validate_arg
+  {
+  const Lzip_index * lzip_index;
+  const uint8_t * map;		// contents of the file, or 0 if not mapped
+  const Pretty_print * pp;
+  std::vector< int > * results;
+  int num_workers;
+  int infd;
+  int worker_id;
+  };
+
+
+/* Test members worker_id, worker_id + num_workers, ... quietly, and store
+   the result of each one in results. */
+extern "C" void * vworker( void * arg )
+  {
+  const Validate_arg & tmp = *(const Validate_arg *)arg;
+  const Lzip_index & lzip_index = *tmp.lzip_index;
+  const Pretty_print & pp = *tmp.pp;
+  Dictionary_buffer dbuf;
+
+  for( long i = tmp.worker_id; i < lzip_index.members(); i += tmp.num_workers )
+    {
+    const Block & mb = lzip_index.mblock( i );
+    try {
+      Pread_source psrc( tmp.infd, mb.pos(), mb.size() );
+      Mem_source msrc( tmp.map ? tmp.map + mb.pos() : 0,
+                       tmp.map ? mb.size() : 0 );
+      Data_source & isrc = tmp.map ? (Data_source &)msrc : (Data_source &)psrc;
+      Range_decoder rdec( isrc );
+      Lzip_header header;	// already checked by Lzip_index
+      rdec.read_data( header.data, header.size );
+      Fd_sink nsnk( -1 );
+      LZ_decoder decoder( rdec, lzip_index.dictionary_size( i ), nsnk,
+                          &dbuf );
+      (*tmp.results)[i] = decoder.decode_member( pp, true );
+      }
+    catch( std::bad_alloc & ) { pp( "Not enough memory." ); cleanup_and_fail( 1 ); }
+    catch( Error & e ) { pp(); show_error( e.msg, errno ); cleanup_and_fail( 1 ); }
+    }
+  return 0;
+  }
+
+
+/* Decode member i again, serially and showing diagnostics, to report the
+   error exactly as the single-threaded decoder would. */
+void show_member_result( const Lzip_index & lzip_index, const long i,
+                         const int infd, const Pretty_print & pp )
+  {
+  const Block & mb = lzip_index.mblock( i );
+  Pread_source isrc( infd, mb.pos(), mb.size() );
+  Range_decoder rdec( isrc );
+  Lzip_header header;
+  rdec.read_data( header.data, header.size );
+  Fd_sink nsnk( -1 );
+  LZ_decoder decoder( rdec, lzip_index.dictionary_size( i ), nsnk );
+  const int result = decoder.decode_member( pp );
+  if( result != 0 )
+    show_member_error( pp, result, mb.pos() + rdec.member_position() );
+  }
+
+} // end namespace
+
+
+/* Return the bytes used by each worker of decompress_mt to decode members
+   of at most dictionary_size bytes; the decoder and its queue of packets
+   of decompressed data waiting to be written. */
+unsigned long long mt_decoder_memory( const unsigned dictionary_size )
+  { return decoder_memory( dictionary_size ) +
+           (unsigned long long)out_slots * max_packet_size; }
+
+
+/* Decode the members of a regular file in parallel and write the
+   decompressed data in order. The file must have been indexed without
+   errors. Return value: 0 = OK, 2 = data error. */
+int decompress_mt( const Lzip_index & lzip_index, const int num_workers,
+                   const int infd, const int outfd, const Pretty_print & pp,
+                   const bool testing, const bool sparse )
+  {
+  const int workers = std::min( (long)num_workers, lzip_index.members() );
+  Packet_courier courier( workers );
+  Fd_sink osnk( outfd, sparse );
+  if( lseek( infd, 0, SEEK_SET ) != 0 )
+    { show_file_error( pp.name(), "Seek error", errno ); return 1; }
+  Mmap_source msrc( infd );	// workers decode members in place if mapped
+  int map_size;
+  const uint8_t * const map = msrc.contents( map_size );
+
+  std::vector< Worker_arg > worker_args( workers );
+  std::vector< pthread_t > worker_threads( workers );
+  for( int i = 0; i < workers; ++i )
+    {
+    Worker_arg & wa = worker_args[i];
+    wa.lzip_index = &lzip_index;
+    wa.map = map;
+    wa.courier = &courier;
+    wa.pp = &pp;
+    wa.num_workers = workers;
+    wa.infd = infd;
+    wa.worker_id = i;
+    wa.testing = testing;
+    const int errcode = pthread_create( &worker_threads[i], 0, dworker, &wa );
+    if( errcode )
+      { show_error( "Can't create worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+
+  const unsigned long long cfile_size = ( lzip_index.file_size() + 99 ) / 100;
+  if( !testing )			// write packets in member order
+    for( long i = 0; i < lzip_index.members(); ++i )
+      {
+      Packet * packet;
+      while( ( packet = courier.deliver_packet( i % workers ) )->data )
+        {
+        if( osnk.write( packet->data, packet->size ) != packet->size )
+          { pp(); show_error( wr_err_msg, errno ); cleanup_and_fail( 1 ); }
+        delete[] packet->data; delete packet;
+        }
+      const int result = packet->result;
+      delete packet;
+      if( result != 0 ) break;
+      show_mt_progress( cfile_size, lzip_index.dblock( i ).end(),
+                        lzip_index.mblock( i ).end(), i + 1, false, pp );
+      }
+  courier.abort();		// release workers blocked on a full queue
+
+  for( int i = workers - 1; i >= 0; --i )
+    {
+    const int errcode = pthread_join( worker_threads[i], 0 );
+    if( errcode )
+      { show_error( "Can't join worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+
+  const long first_error = courier.first_error();
+  if( first_error < lzip_index.members() )
+    { show_member_result( lzip_index, first_error, infd, pp ); return 2; }
+  if( verbosity >= 1 ) std::fputs( testing ? "ok\n" : "done\n", stderr );
+  return 0;
+  }
+
+
+/* Test all the members of a regular file in parallel, without writing
+   anything, and store in results[i] the result of member i (0 = OK). Used
+   to find the members of a damaged file that can be recovered.
+   Return value: 0 = OK, 1 = seek error. */
+int validate_members( const Lzip_index & lzip_index, const int num_workers,
+                      const int infd, const Pretty_print & pp,
+                      std::vector< int > & results )
+  {
+  const int workers = std::min( (long)num_workers, lzip_index.members() );
+  results.assign( lzip_index.members(), 0 );
+  if( lseek( infd, 0, SEEK_SET ) != 0 )	// map from the start
+    { show_file_error( pp.name(), "Seek error", errno ); return 1; }
+  Mmap_source msrc( infd );	// workers decode members in place if mapped
+  int map_size;
+  const uint8_t * const map = msrc.contents( map_size );
+
+  std::vector< Validate_arg > worker_args( workers );
+  std::vector< pthread_t > worker_threads( workers );
+  for( int i = 0; i < workers; ++i )
+    {
+    Validate_arg & va = worker_args[i];
+    va.lzip_index = &lzip_index;
+    va.map = map;
+    va.pp = &pp;
+    va.results = &results;
+    va.num_workers = workers;
+    va.infd = infd;
+    va.worker_id = i;
+    const int errcode = pthread_create( &worker_threads[i], 0, vworker, &va );
+    if( errcode )
+      { show_error( "Can't create worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+  for( int i = workers - 1; i >= 0; --i )
+    {
+    const int errcode = pthread_join( worker_threads[i], 0 );
+    if( errcode )
+      { show_error( "Can't join worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+  return 0;
+  }
+
+
+namespace {
+
+enum { max_stream_member_size = 1 << 27, in_slots = 2 };
+
+struct Member_data		// a member read from a stream
+  {
+  std::vector< uint8_t > data;
+  unsigned long long pos;	// position of the member in the stream
+  unsigned dictionary_size;
+  };
+
+
+/* Moves the members found by the splitter to the workers. Member i goes to
+   worker (i % num_workers); a null member tells a worker to stop. */
+class Member_feed
+  {
+  std::vector< std::deque< Member_data * > > imembers;	// one per worker
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;	// a member was queued or taken, or aborted
+  bool aborted;
+
+  Member_feed( const Member_feed & );		// declared as private
+  void operator=( const Member_feed & );	// declared as private
+
+public:
+  explicit Member_feed( const int num_workers )
+    : imembers( num_workers ), aborted( false )
+    { xinit_mutex( &mutex ); xinit_cond( &changed ); }
+
+  ~Member_feed()
+    {
+    for( unsigned i = 0; i < imembers.size(); ++i )
+      for( unsigned j = 0; j < imembers[i].size(); ++j )
+        delete imembers[i][j];
+    xdestroy_cond( &changed ); xdestroy_mutex( &mutex );
+    }
+
+  // Return false (and delete the member) if aborted.
+  bool push( const int worker_id, Member_data * const member )
+    {
+    xlock( &mutex );
+    std::deque< Member_data * > & q = imembers[worker_id];
+    if( member )
+      while( q.size() >= in_slots && !aborted ) xwait( &changed, &mutex );
+    const bool ok = !aborted;
+    if( ok ) { q.push_back( member ); xbroadcast( &changed ); }
+    xunlock( &mutex );
+    if( !ok ) delete member;
+    return ok;
+    }
+
+  // Return the next member of worker_id, or 0 if no more or aborted.
+  Member_data * pop( const int worker_id )
+    {
+    xlock( &mutex );
+    std::deque< Member_data * > & q = imembers[worker_id];
+    while( q.empty() && !aborted ) xwait( &changed, &mutex );
+    Member_data * member = 0;
+    if( !aborted ) { member = q.front(); q.pop_front(); xbroadcast( &changed ); }
+    xunlock( &mutex );
+    return member;
+    }
+
+  void abort()
+    { xlock( &mutex ); aborted = true; xbroadcast( &changed );
+      xunlock( &mutex ); }
+  };
+
+
+struct Splitter_arg
+  {
+  Stream_scanner * scanner;
+  Member_feed * feed;
+  int num_workers;
+  long members;			// members sent to the workers
+  Stream_scanner::Result result;	// why the splitter stopped
+  };
+
+
+/* Split the stream in members and queue them for the workers. Stop at the
+   first thing that is not a complete member followed by another member or
+   by the end of the stream; the rest of the stream is left to the caller. */
+extern "C" void * dsplitter( void * arg )
+  {
+  Splitter_arg & tmp = *(Splitter_arg *)arg;
+  Stream_scanner & scanner = *tmp.scanner;
+  Member_feed & feed = *tmp.feed;
+  long i = 0;
+  Stream_scanner::Result res;
+  try {
+    while( true )
+      {
+      Lzip_header header;
+      res = scanner.read_header( header );
+      if( res == Stream_scanner::found )
+        res = header.check() ? scanner.find_member_end( max_stream_member_size )
+                             : Stream_scanner::truncated;	// not a member
+      if( res != Stream_scanner::found ) break;
+      Member_data * const member = new Member_data;
+      member->pos = scanner.mpos();
+      member->dictionary_size = header.dictionary_size();
+      scanner.take_member( &member->data );
+      if( !feed.push( i % tmp.num_workers, member ) ) break;
+      ++i;
+      }
+    }
+  catch( std::bad_alloc & ) { show_error( "Not enough memory." ); cleanup_and_fail( 1 ); }
+  tmp.members = i; tmp.result = res;
+  for( int j = 0; j < tmp.num_workers; ++j ) feed.push( j, 0 );
+  return 0;
+  }
+
+
+struct Stream_worker_arg
+  {
+  Member_feed * feed;
+  Packet_courier * courier;
+  const Pretty_print * pp;
+  Member_data * failed;		// member that failed, kept for the report
+  long failed_member;		// index of the member that failed
+  int num_workers;
+  int worker_id;
+  bool testing;
+  };
+
+
+/* Decode the members queued for worker_id quietly. After each member, queue
+   an end of member packet, with result -1 if there are no more members. */
+extern "C" void * sworker( void * arg )
+  {
+  Stream_worker_arg & tmp = *(Stream_worker_arg *)arg;
+  Packet_courier & courier = *tmp.courier;
+  const Pretty_print & pp = *tmp.pp;
+  Dictionary_buffer dbuf;
+
+  for( long i = tmp.worker_id; ; i += tmp.num_workers )
+    {
+    Member_data * const member = tmp.feed->pop( tmp.worker_id );
+    if( !member )
+      { courier.collect_packet( tmp.worker_id, new Packet( 0, 0, -1 ) );
+        break; }
+    const int msize = member->data.size();
+    unsigned long long dsize = 0;
+    int result = 0;
+    if( courier.first_error() > i )
+      try {
+        Mem_source isrc( &member->data[0], member->data.size() );
+        Range_decoder rdec( isrc );
+        Lzip_header header;	// already checked by the splitter
+        rdec.read_data( header.data, header.size );
+        Courier_sink csnk( courier, tmp.worker_id );
+        Fd_sink nsnk( -1 );			// discard data if testing
+        Data_sink & osnk = tmp.testing ? (Data_sink &)nsnk : (Data_sink &)csnk;
+        LZ_decoder decoder( rdec, member->dictionary_size, osnk, &dbuf );
+        result = decoder.decode_member( pp, true );
+        dsize = decoder.data_position();
+        }
+      catch( std::bad_alloc & ) { pp( "Not enough memory." ); cleanup_and_fail( 1 ); }
+      catch( Error & e )
+        {
+        if( courier.aborted() ) { delete member; break; }
+        pp(); show_error( e.msg, errno ); cleanup_and_fail( 1 );
+        }
+    else result = 2;		// a previous member has failed; don't decode
+    if( result != 0 && courier.first_error() > i )
+      { courier.set_error( i ); tmp.failed = member; tmp.failed_member = i; }
+    else delete member;
+    if( !courier.collect_packet( tmp.worker_id,
+                                 new Packet( 0, msize, result, dsize ) ) ||
+        result != 0 ) break;
+    }
+  return 0;
+  }
+
+} // end namespace
+
+
+/* Decode a non-seekable stream in parallel. A splitter thread finds the
+   members as the stream is read, and the workers decode them from memory.
+   If the splitter finds anything other than a sequence of complete members
+   (trailing data, a truncated or corrupt member, a member too large to be
+   kept in memory), the members before it are decoded and written, and the
+   bytes already read from the first member not decoded are moved to 'rest'
+   so that the caller decodes the rest of the stream serially starting at
+   'rest_pos', reporting any errors as usual. The size of the data written
+   is returned in 'data_pos'.
+   Return value: 0 = OK, 2 = data error, -1 = decode the rest serially. */
+int decompress_mt_stream( const int num_workers, const int infd,
+                          const int outfd, const Pretty_print & pp,
+                          const bool testing, const bool sparse,
+                          std::vector< uint8_t > & rest,
+                          unsigned long long & rest_pos,
+                          unsigned long long & data_pos )
+  {
+  Fd_source fsrc( infd );
+  Fd_sink osnk( outfd, sparse );
+  Stream_scanner scanner( fsrc, true );
+  Member_feed feed( num_workers );
+  Packet_courier courier( num_workers );
+
+  Splitter_arg splitter_arg;
+  splitter_arg.scanner = &scanner;
+  splitter_arg.feed = &feed;
+  splitter_arg.num_workers = num_workers;
+  splitter_arg.members = 0;
+  splitter_arg.result = Stream_scanner::eof;
+  pthread_t splitter_thread;
+  int errcode = pthread_create( &splitter_thread, 0, dsplitter, &splitter_arg );
+  if( errcode )
+    { show_error( "Can't create splitter thread", errcode );
+      cleanup_and_fail( 1 ); }
+
+  std::vector< Stream_worker_arg > worker_args( num_workers );
+  std::vector< pthread_t > worker_threads( num_workers );
+  for( int i = 0; i < num_workers; ++i )
+    {
+    Stream_worker_arg & wa = worker_args[i];
+    wa.feed = &feed;
+    wa.courier = &courier;
+    wa.pp = &pp;
+    wa.failed = 0;
+    wa.failed_member = -1;
+    wa.num_workers = num_workers;
+    wa.worker_id = i;
+    wa.testing = testing;
+    errcode = pthread_create( &worker_threads[i], 0, sworker, &wa );
+    if( errcode )
+      { show_error( "Can't create worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+
+  unsigned long long udata = 0, cdata = 0;
+  for( long i = 0; ; ++i )		// write packets in member order
+    {
+    Packet * packet;
+    while( true )
+      {
+      packet = courier.deliver_packet( i % num_workers );
+      if( verbosity == 1 && packet->result >= 0 ) pp();	// member found
+      if( !packet->data ) break;
+      if( osnk.write( packet->data, packet->size ) != packet->size )
+        { pp(); show_error( wr_err_msg, errno ); cleanup_and_fail( 1 ); }
+      delete[] packet->data; delete packet;
+      }
+    const int result = packet->result;
+    udata += packet->dsize; cdata += packet->size;
+    delete packet;
+    if( result != 0 ) break;		// error, or no more members
+    show_mt_progress( 0, udata, cdata, i + 1, false, pp );
+    }
+  data_pos = udata;
+  courier.abort();		// release workers blocked on a full queue
+  feed.abort();			// release the splitter and idle workers
+
+  for( int i = num_workers - 1; i >= 0; --i )
+    {
+    errcode = pthread_join( worker_threads[i], 0 );
+    if( errcode )
+      { show_error( "Can't join worker threads", errcode );
+        cleanup_and_fail( 1 ); }
+    }
+  errcode = pthread_join( splitter_thread, 0 );
+  if( errcode )
+    { show_error( "Can't join splitter thread", errcode );
+      cleanup_and_fail( 1 ); }
+
+  const long first_error = courier.first_error();
+  const Member_data * failed = 0;
+  for( int i = 0; i < num_workers; ++i )
+    {
+    if( worker_args[i].failed_member == first_error )
+      failed = worker_args[i].failed;
+    else delete worker_args[i].failed;
+    }
+  if( failed )		// decode the member again to report the error
+    {
+    Mem_source isrc( &failed->data[0], failed->data.size() );
+    Range_decoder rdec( isrc );
+    Lzip_header header;
+    rdec.read_data( header.data, header.size );
+    Fd_sink nsnk( -1 );
+    LZ_decoder decoder( rdec, failed->dictionary_size, nsnk );
+    const int result = decoder.decode_member( pp );
+    if( result != 0 )
+      show_member_error( pp, result, failed->pos + rdec.member_position() );
+    delete failed;
+    return 2;
+    }
+  const Stream_scanner::Result res = splitter_arg.result;
+  if( res == Stream_scanner::read_error )
+    { errno = scanner.read_errno(); throw Error( "Read error" ); }
+  if( res != Stream_scanner::eof || splitter_arg.members == 0 )
+    { rest_pos = scanner.mpos(); scanner.take_rest( rest ); return -1; }
+  if( verbosity >= 1 ) std::fputs( testing ? "ok\n" : "done\n", stderr );
+  rest_pos = cdata;
+  return 0;
+  }
@@ -35,6 +35,7 @@ const CRC32 crc32;
 
 int LZ_encoder::get_match_pairs( Pair * pairs )
   {
+  STATS_TIMER( st_match );
   int len_limit = match_len_limit;
   if( len_limit > available_bytes() )
     {
@@ -44,7 +45,9 @@ int LZ_encoder::get_match_pairs( Pair * pairs )
 
   int maxlen = 3;			// only used if pairs != 0
   int num_pairs = 0;
-  const int min_pos = ( pos > dictionary_size ) ? pos - dictionary_size : 0;
+  const int min_pos = pos_offset +
+                      ( ( pos > dictionary_size ) ? pos - dictionary_size : 0 );
+  const int pos1 = pos_offset + pos + 1;
   const uint8_t * const data = ptr_to_current_pos();
 
   unsigned tmp = crc32[data[0]] ^ data[1];
@@ -58,29 +61,27 @@ int LZ_encoder::get_match_pairs( Pair * pairs )
     {
     const int np2 = prev_positions[key2];
     const int np3 = prev_positions[key3];
-    if( np2 > min_pos && buffer[np2-1] == data[0] )
+    if( np2 > min_pos && data[np2-pos1] == data[0] )
       {
-      pairs[0].dis = pos - np2;
+      pairs[0].dis = pos1 - 1 - np2;
       pairs[0].len = maxlen = 2 + ( np2 == np3 );
       num_pairs = 1;
       }
-    if( np2 != np3 && np3 > min_pos && buffer[np3-1] == data[0] )
+    if( np2 != np3 && np3 > min_pos && data[np3-pos1] == data[0] )
       {
       maxlen = 3;
-      pairs[num_pairs++].dis = pos - np3;
+      pairs[num_pairs++].dis = pos1 - 1 - np3;
       }
     if( num_pairs > 0 )
       {
       const int delta = pairs[num_pairs-1].dis + 1;
-      while( maxlen < len_limit && data[maxlen-delta] == data[maxlen] )
-        ++maxlen;
+      maxlen = match_len( data, delta, maxlen, len_limit );
       pairs[num_pairs-1].len = maxlen;
       if( maxlen < 3 ) maxlen = 3;
       if( maxlen >= len_limit ) pairs = 0;	// done. now just skip
       }
     }
 
-  const int pos1 = pos + 1;
   prev_positions[key2] = pos1;
   prev_positions[key3] = pos1;
   int newpos1 = prev_positions[key4];
@@ -100,7 +101,7 @@ int LZ_encoder::get_match_pairs( Pair * pairs )
           ( ( cyclic_pos >= delta ) ? 0 : dictionary_size + 1 ) ) << 1 );
     if( data[len-delta] == data[len] )
       {
-      while( ++len < len_limit && data[len-delta] == data[len] ) {}
+      len = match_len( data, delta, len + 1, len_limit );
       if( pairs && maxlen < len )
         {
         pairs[num_pairs].dis = delta - 1;
@@ -135,6 +136,7 @@ int LZ_encoder::get_match_pairs( Pair * pairs )
 
 void LZ_encoder::update_distance_prices()
   {
+  STATS_TIMER( st_dis_prices );
   for( int dis = start_dis_model; dis < modeled_distances; ++dis )
     {
     const int dis_slot = dis_slots[dis];
@@ -175,6 +177,7 @@ void LZ_encoder::update_distance_prices()
 int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
                                     const State state )
   {
+  STATS_TIMER( st_parse );
   int num_pairs, num_trials;
 
   if( pending_num_pairs > 0 )			// from previous call
@@ -364,7 +367,7 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
       const int dis = cur_trial.reps[0] + 1;
       const int limit = std::min( match_len_limit + 1, triable_bytes );
       int len = 1;
-      while( len < limit && data[len-dis] == data[len] ) ++len;
+      len = match_len( data, dis, len, limit );
       if( --len >= min_match_len )
         {
         const int pos_state2 = ( pos_state + 1 ) & pos_state_mask;
@@ -403,7 +406,7 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
       // try rep + literal + rep0
       int len2 = len + 1;
       const int limit = std::min( match_len_limit + len2, triable_bytes );
-      while( len2 < limit && data[len2-dis] == data[len2] ) ++len2;
+      len2 = match_len( data, dis, len2, limit );
       len2 -= len + 1;
       if( len2 < min_match_len ) continue;
 
@@ -446,7 +449,7 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
           const int dis2 = dis + 1;
           int len2 = len + 1;
           const int limit = std::min( match_len_limit + len2, triable_bytes );
-          while( len2 < limit && data[len2-dis2] == data[len2] ) ++len2;
+          len2 = match_len( data, dis2, len2, limit );
           len2 -= len + 1;
           if( len2 >= min_match_len )
             {
@@ -488,6 +491,7 @@ bool LZ_encoder::encode_member( const unsigned long long member_size )
   int reps[num_rep_distances];
   State state;
   for( int i = 0; i < num_rep_distances; ++i ) reps[i] = 0;
+  Literal_probe probe;		// detection of incompressible data
 
   if( data_position() != 0 || renc.member_position() != Lzip_header::size )
     return false;				// can be called only once
@@ -505,6 +509,11 @@ bool LZ_encoder::encode_member( const unsigned long long member_size )
 
   while( !data_finished() )
     {
+    const int lr = encode_literal_run( probe, state, reps[0],
+                                       member_size_limit );
+    if( lr == 2 ) return true;			// member full
+    if( lr == 1 ) { pending_num_pairs = 0; if( data_finished() ) break; }
+
     if( price_counter <= 0 && pending_num_pairs == 0 )
       {
       price_counter = price_count;	// recalculate prices every these bytes
@@ -512,6 +521,7 @@ bool LZ_encoder::encode_member( const unsigned long long member_size )
         { dis_price_counter = dis_price_count; update_distance_prices(); }
       if( align_price_counter <= 0 )
         {
+        STATS_TIMER( st_align_prices );
         align_price_counter = align_price_count;
         for( int i = 0; i < dis_align_size; ++i )
           align_prices[i] = price_symbol_reversed( bm_align, i, dis_align_bits );
@@ -523,6 +533,7 @@ bool LZ_encoder::encode_member( const unsigned long long member_size )
     int ahead = sequence_optimizer( reps, state );
     price_counter -= ahead;
 
+    STATS_TIMER( st_encode );
     for( int i = 0; ahead > 0; )
       {
       const int pos_state = ( data_position() - ahead ) & pos_state_mask;
@@ -530,6 +541,7 @@ bool LZ_encoder::encode_member( const unsigned long long member_size )
       int dis = trials[i].dis4;
 
       bool bit = dis < 0;
+      STATS( stats_sequence( bit ? 0 : len, !bit && dis < num_rep_distances ) );
       renc.encode_bit( bm_match[state()][pos_state], !bit );
       if( bit )					// literal byte
         {
@@ -25,6 +25,7 @@ class Len_prices
 
   void update_low_mid_prices( const int pos_state )
     {
+    STATS_TIMER( st_len_prices );
     int * const pps = prices[pos_state];
     int tmp = price0( lm.choice1 );
     int len = 0;
@@ -39,6 +40,7 @@ class Len_prices
 
   void update_high_prices()
     {
+    STATS_TIMER( st_len_prices );
     const int tmp = price1( lm.choice1 ) + price1( lm.choice2 );
     for( int len = len_low_symbols + len_mid_symbols; len < len_symbols; ++len )
       // using 4 slots per value makes "price" faster
@@ -123,16 +125,16 @@ class LZ_encoder : public LZ_encoder_base
 
   const int cycles;
   const int match_len_limit;
+  // the price tables are kept together, before the large trials array
   Len_prices match_len_prices;
   Len_prices rep_len_prices;
-  int pending_num_pairs;
-  Pair pairs[max_match_len+1];
-  Trial trials[max_num_trials];
-
   int dis_slot_prices[len_states][2*max_dictionary_bits];
   int dis_prices[len_states][modeled_distances];
   int align_prices[dis_align_size];
-  const int num_dis_slots;
+  int num_dis_slots;
+  int pending_num_pairs;
+  Pair pairs[max_match_len+1];
+  Trial trials[max_num_trials];
 
   bool dec_pos( const int ahead )
     {
@@ -262,17 +264,22 @@ class LZ_encoder : public LZ_encoder_base
          pos_array_factor = 2 };
 
 public:
+  static unsigned long long memory_needed( const int dict_size )
+    { return sizeof (LZ_encoder) + Matchfinder_base::memory_needed(
+        before_size, dict_size, after_size, dict_factor,
+        num_prev_positions23, pos_array_factor ); }
+
   LZ_encoder( const int dict_size, const int len_limit,
-              const int ifd, const int outfd )
+              Data_source & src, Data_sink & snk )
     :
     LZ_encoder_base( before_size, dict_size, after_size, dict_factor,
-                     num_prev_positions23, pos_array_factor, ifd, outfd ),
+                     num_prev_positions23, pos_array_factor, src, snk ),
     cycles( ( len_limit < max_match_len ) ? 16 + ( len_limit / 2 ) : 256 ),
     match_len_limit( len_limit ),
     match_len_prices( match_len_model, match_len_limit ),
     rep_len_prices( rep_len_model, match_len_limit ),
-    pending_num_pairs( 0 ),
-    num_dis_slots( 2 * real_bits( dictionary_size - 1 ) )
+    num_dis_slots( 2 * real_bits( dictionary_size - 1 ) ),
+    pending_num_pairs( 0 )
     {
     trials[1].prev_index = 0;
     trials[1].prev_index2 = single_step_trial;
@@ -286,5 +293,11 @@ public:
     pending_num_pairs = 0;
     }
 
+  void reset_stream( Data_source & src, Data_sink & snk )
+    {
+    LZ_encoder_base::reset_stream( src, snk );
+    num_dis_slots = 2 * real_bits( dictionary_size - 1 );
+    }
+
   bool encode_member( const unsigned long long member_size );
   };
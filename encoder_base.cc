@@ -39,7 +39,7 @@ bool Matchfinder_base::read_block()
   if( !at_stream_end && stream_pos < buffer_size )
     {
     const int size = buffer_size - stream_pos;
-    const int rd = readblock( infd, buffer + stream_pos, size );
+    const int rd = isrc->read( buffer + stream_pos, size );
     stream_pos += rd;
     if( rd != size && errno ) throw Error( "Read error" );
     if( rd < size ) { at_stream_end = true; pos_limit = buffer_size; }
@@ -52,7 +52,14 @@ void Matchfinder_base::normalize_pos()
   {
   if( pos > stream_pos )
     internal_error( "pos > stream_pos in normalize_pos." );
-  if( !at_stream_end )
+  if( external_buffer )	// release the mapped data behind the dictionary
+    {
+    const int end = pos - before_size - dictionary_size;
+    if( end > 0 ) isrc->discard( buffer + end );
+    pos_limit = ( buffer_size - pos > discard_step ) ?
+                pos + discard_step : buffer_size;
+    }
+  else if( !at_stream_end )
     {
     // offset is int32_t for the std::min below
     const int32_t offset = pos - before_size - dictionary_size;
@@ -61,84 +68,182 @@ void Matchfinder_base::normalize_pos()
     partial_data_pos += offset;
     pos -= offset;		// pos = before_size + dictionary_size
     stream_pos -= offset;
-    for( int i = 0; i < num_prev_positions; ++i )
-      prev_positions[i] -= std::min( prev_positions[i], offset );
-    for( int i = 0; i < pos_array_size; ++i )
-      pos_array[i] -= std::min( pos_array[i], offset );
+    advance_offset( offset );
     read_block();
     }
   }
 
 
+// Forget all the positions stored in prev_positions.
+void Matchfinder_base::clear_positions()
+  {
+  for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = 0;
+  pos_offset = 0;
+  }
+
+
+/* The data in buffer have been moved back by 'offset' bytes. Instead of
+   subtracting offset from every stored position, add it to pos_offset.
+   Stored positions not greater than pos_offset are treated as empty, so
+   this also discards the positions moved out of the buffer. Only when
+   pos_offset would overflow are the arrays walked to rebase them. */
+void Matchfinder_base::advance_offset( const int offset )
+  {
+  const long long new_offset = (long long)pos_offset + offset;
+  if( new_offset + buffer_size + 1 <= 0x7FFFFFFF )
+    { pos_offset = new_offset; return; }
+  const int size = num_prev_positions + pos_array_size;
+  for( int i = 0; i < size; ++i )
+    prev_positions[i] = ( prev_positions[i] > new_offset ) ?
+                        prev_positions[i] - new_offset : 0;
+  pos_offset = 0;
+  }
+
+
 Matchfinder_base::Matchfinder_base( const int before_size_,
                     const int dict_size, const int after_size,
                     const int dict_factor, const int num_prev_positions23_,
-                    const int pos_array_factor, const int ifd )
+                    const int pos_array_factor, Data_source & src )
   :
-  partial_data_pos( 0 ),
+  owned_buffer( 0 ),
+  prev_positions( 0 ),
   before_size( before_size_ ),
-  pos( 0 ),
-  cyclic_pos( 0 ),
-  stream_pos( 0 ),
+  after_size_( after_size ),
+  dict_size_( dict_size ),
+  dict_factor_( dict_factor ),
+  owned_size( 0 ),
   num_prev_positions23( num_prev_positions23_ ),
-  infd( ifd ),
-  at_stream_end( false )
+  pos_array_factor_( pos_array_factor ),
+  prev_size( 0 )
+  {
+  try { init( src ); }
+  catch( ... ) { free_arrays(); throw; }
+  }
+
+
+// number of entries of the hash table of 4-byte keys
+unsigned Matchfinder_base::hash_size( const int dictionary_size )
+  {
+  unsigned size = 1 << std::max( 16, real_bits( dictionary_size - 1 ) - 2 );
+  if( dictionary_size > 1 << 26 ) size >>= 1;		// 64 MiB
+  return size;
+  }
+
+
+unsigned long long Matchfinder_base::memory_needed( const int before_size,
+  const int dict_size, const int after_size, const int dict_factor,
+  const int num_prev_positions23, const int pos_array_factor )
+  {
+  const unsigned long long buffer_size = std::max( 65536ULL,
+    (unsigned long long)dict_factor * dict_size + before_size + after_size );
+  const unsigned long long positions = hash_size( dict_size ) +
+    num_prev_positions23 + pos_array_factor * ( dict_size + 1ULL );
+  return buffer_size + positions * sizeof (int32_t);
+  }
+
+
+/* Start a new stream from src, reusing the buffers already allocated if
+   they are large enough. */
+void Matchfinder_base::init( Data_source & src )
   {
-  const int buffer_size_limit =
-    ( dict_factor * dict_size ) + before_size + after_size;
-  buffer_size = std::max( 65536, dict_size );
-  buffer = (uint8_t *)std::malloc( buffer_size );
-  if( !buffer ) throw std::bad_alloc();
-  if( read_block() && !at_stream_end && buffer_size < buffer_size_limit )
+  isrc = &src;
+  partial_data_pos = 0;
+  pos = 0;
+  cyclic_pos = 0;
+  stream_pos = 0;
+  at_stream_end = false;
+  int data_size = 0;
+  const uint8_t * const data = isrc->contents( data_size );
+  if( data )		// use the data in place; no reads or memmoves needed
     {
-    uint8_t * const tmp = (uint8_t *)std::realloc( buffer, buffer_size_limit );
-    if( !tmp ) { std::free( buffer ); throw std::bad_alloc(); }
-    buffer = tmp;
-    buffer_size = buffer_size_limit;
-    read_block();
+    buffer = const_cast< uint8_t * >( data );
+    buffer_size = stream_pos = data_size;
+    at_stream_end = true;
+    external_buffer = true;
+    }
+  else
+    {
+    const int buffer_size_limit =
+      ( dict_factor_ * dict_size_ ) + before_size + after_size_;
+    if( !owned_buffer )
+      {
+      owned_size = std::max( 65536, dict_size_ );
+      owned_buffer = (uint8_t *)large_alloc( owned_size );
+      if( !owned_buffer ) { owned_size = 0; throw std::bad_alloc(); }
+      }
+    buffer = owned_buffer;
+    buffer_size = owned_size;
+    external_buffer = false;
+    if( read_block() && !at_stream_end && buffer_size < buffer_size_limit )
+      {
+      uint8_t * const tmp = (uint8_t *)
+        large_realloc( buffer, owned_size, buffer_size_limit );
+      if( !tmp ) throw std::bad_alloc();
+      buffer = owned_buffer = tmp;
+      buffer_size = owned_size = buffer_size_limit;
+      read_block();
+      }
     }
-  if( at_stream_end && stream_pos < dict_size )
+  if( at_stream_end && stream_pos < dict_size_ )
     dictionary_size = std::max( (int)min_dictionary_size, stream_pos );
   else
-    dictionary_size = dict_size;
+    dictionary_size = dict_size_;
   pos_limit = buffer_size;
-  if( !at_stream_end ) pos_limit -= after_size;
-  unsigned size = 1 << std::max( 16, real_bits( dictionary_size - 1 ) - 2 );
-  if( dictionary_size > 1 << 26 ) size >>= 1;		// 64 MiB
+  if( !at_stream_end ) pos_limit -= after_size_;
+  else if( external_buffer && buffer_size > discard_step )
+    pos_limit = discard_step;
+  unsigned size = hash_size( dictionary_size );
   key4_mask = size - 1;			// increases with dictionary size
   size += num_prev_positions23;
   num_prev_positions = size;
 
-  pos_array_size = pos_array_factor * ( dictionary_size + 1 );
+  pos_array_size = pos_array_factor_ * ( dictionary_size + 1 );
   size += pos_array_size;
-  if( size * sizeof prev_positions[0] <= size ) prev_positions = 0;
-  else prev_positions = new( std::nothrow ) int32_t[size];
-  if( !prev_positions ) { std::free( buffer ); throw std::bad_alloc(); }
+  if( size > prev_size )
+    {
+    large_free( prev_positions, prev_size * sizeof prev_positions[0] );
+    prev_size = 0;
+    if( size * sizeof prev_positions[0] <= size ) prev_positions = 0;
+    else prev_positions =
+      (int32_t *)large_alloc( size * sizeof prev_positions[0] );
+    if( !prev_positions ) throw std::bad_alloc();
+    prev_size = size;
+    }
   pos_array = prev_positions + num_prev_positions;
-  for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = 0;
+  clear_positions();
   }
 
 
 void Matchfinder_base::reset()
   {
-  if( stream_pos > pos )
+  /* No position beyond the lookahead inserted by the encoder has been
+     stored. Don't use stream_pos as the bound; it may be the end of a
+     mapped file, which would make advance_offset rebase the arrays at
+     every member. */
+  const int offset = std::min( pos + after_size_, stream_pos );
+  if( external_buffer )		// just move the start of the buffer
+    { buffer += pos; buffer_size -= pos;
+      pos_limit = std::min( buffer_size, (int)discard_step ); }
+  else if( stream_pos > pos )
     std::memmove( buffer, buffer + pos, stream_pos - pos );
   partial_data_pos = 0;
   stream_pos -= pos;
   pos = 0;
   cyclic_pos = 0;
   read_block();
+  const int old_num_prev_positions = num_prev_positions;
   if( at_stream_end && stream_pos < dictionary_size )
     {
     dictionary_size = std::max( (int)min_dictionary_size, stream_pos );
-    int size = 1 << std::max( 16, real_bits( dictionary_size - 1 ) - 2 );
-    if( dictionary_size > 1 << 26 ) size >>= 1;		// 64 MiB
+    unsigned size = hash_size( dictionary_size );
     key4_mask = size - 1;
     size += num_prev_positions23;
     num_prev_positions = size;
     pos_array = prev_positions + num_prev_positions;
     }
-  for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = 0;
+  // positions of the previous member (and of the lookahead) are now stale
+  if( num_prev_positions != old_num_prev_positions ) clear_positions();
+  else advance_offset( offset );
   }
 
 
@@ -146,7 +251,7 @@ void Range_encoder::flush_data()
   {
   if( pos > 0 )
     {
-    if( outfd >= 0 && writeblock( outfd, buffer, pos ) != pos )
+    if( osnk->write( buffer, pos ) != pos )
       throw Error( wr_err_msg );
     partial_member_pos += pos;
     pos = 0;
@@ -156,6 +261,56 @@ void Range_encoder::flush_data()
 
 
 // End Of Stream marker => (dis == 0xFFFFFFFFU, len == min_match_len)
+/* Probe the compressibility of the data every probe_size bytes, and
+   encode a run of literals if the data seem incompressible.
+   Return value: 0 = no literals encoded, 1 = run of literals encoded,
+   2 = member finished by member_size_limit (already flushed). */
+int LZ_encoder_base::encode_literal_run( Literal_probe & probe, State & state,
+                                         const int rep0,
+                                const unsigned long long member_size_limit )
+  {
+  typedef Literal_probe P;
+  const unsigned long long dsize = data_position() - probe.dpos;
+  if( dsize < P::probe_size ) return 0;
+  int retval = 0;
+  if( renc.member_position() - probe.mpos < dsize - dsize / 32 )
+    probe.run = P::min_run;			// data are compressible
+  else						// encode literals
+    {
+    STATS_TIMER( st_encode );
+    bool compressible = false;
+    for( int i = 0; i < probe.run && !data_finished() && !compressible; )
+      {
+      const unsigned long long chunk_mpos = renc.member_position();
+      const int chunk_end = i + P::chunk_size;
+      for( ; i < chunk_end && !data_finished(); ++i )
+        {
+        const int pos_state = data_position() & pos_state_mask;
+        const uint8_t prev_byte = peek( 1 );
+        const uint8_t cur_byte = peek( 0 );
+        STATS( stats_sequence( 0, false ) );
+        renc.encode_bit( bm_match[state()][pos_state], 0 );
+        crc32.update_byte( crc_, cur_byte );
+        if( state.is_char_set_char() )
+          encode_literal( prev_byte, cur_byte );
+        else
+          encode_matched( prev_byte, cur_byte, peek( rep0 + 1 ) );
+        move_pos();
+        if( renc.member_position() >= member_size_limit )
+          { full_flush( state ); return 2; }
+        }
+      compressible = ( renc.member_position() - chunk_mpos ) * 16 <
+                     P::chunk_size * 15;
+      }
+    probe.run = compressible ? P::min_run :
+                std::min( 2 * probe.run, (int)P::max_run );
+    retval = 1;
+    }
+  probe.dpos = data_position(); probe.mpos = renc.member_position();
+  return retval;
+  }
+
+
 void LZ_encoder_base::full_flush( const State state )
   {
   const int pos_state = data_position() & pos_state_mask;
@@ -172,21 +327,18 @@ void LZ_encoder_base::full_flush( const State state )
   }
 
 
+void LZ_encoder_base::reset_stream( Data_source & src, Data_sink & snk )
+  {
+  Matchfinder_base::init( src );
+  renc.set_sink( snk );
+  reset();
+  }
+
+
 void LZ_encoder_base::reset()
   {
   Matchfinder_base::reset();
   crc_ = 0xFFFFFFFFU;
-  bm_literal[0][0].reset( (1 << literal_context_bits) * 0x300 );
-  bm_match[0][0].reset( State::states * pos_states );
-  bm_rep[0].reset( State::states );
-  bm_rep0[0].reset( State::states );
-  bm_rep1[0].reset( State::states );
-  bm_rep2[0].reset( State::states );
-  bm_len[0][0].reset( State::states * pos_states );
-  bm_dis_slot[0][0].reset( len_states * (1 << dis_slot_bits) );
-  bm_dis[0].reset( modeled_distances - end_dis_model + 1 );
-  bm_align[0].reset( dis_align_size );
-  match_len_model.reset();
-  rep_len_model.reset();
+  Lzma_model::reset();
   renc.reset( dictionary_size );
   }
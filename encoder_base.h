@@ -160,21 +160,57 @@ inline int price_matched( const Bit_model bm[], unsigned symbol,
   }
 
 
+/* Return the first i >= index such that i >= limit or
+   data[i-distance] != data[i]. On little endian machines compare 8 bytes
+   at a time; the first mismatching byte is the lowest set byte of the
+   XOR of both words. Never reads data[limit] or beyond. */
+inline int match_len( const uint8_t * const data, const int distance,
+                      int i, const int limit )
+  {
+#if defined __GNUC__ && defined __BYTE_ORDER__ && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for( ; i + 8 <= limit; i += 8 )
+    {
+    uint64_t a, b;
+    std::memcpy( &a, data + i - distance, 8 );
+    std::memcpy( &b, data + i, 8 );
+    if( a != b ) return i + ( __builtin_ctzll( a ^ b ) >> 3 );
+    }
+#endif
+  while( i < limit && data[i-distance] == data[i] ) ++i;
+  return i;
+  }
+
+
 class Matchfinder_base
   {
+  // mapped data are released every discard_step bytes coded
+  enum { discard_step = 1 << 22 };
+
   bool read_block();
   void normalize_pos();
+  void clear_positions();
+  void advance_offset( const int offset );
+  void free_arrays()
+    { large_free( prev_positions, prev_size * sizeof prev_positions[0] );
+      large_free( owned_buffer, owned_size ); }
 
   Matchfinder_base( const Matchfinder_base & );	// declared as private
   void operator=( const Matchfinder_base & );	// declared as private
 
 protected:
   unsigned long long partial_data_pos;
-  uint8_t * buffer;		// input buffer
+  uint8_t * buffer;		// input buffer, or the data of isrc
+  uint8_t * owned_buffer;	// allocated input buffer, or 0
   int32_t * prev_positions;	// 1 + last seen position of key. else 0
   int32_t * pos_array;		// may be tree or chain
+  int32_t pos_offset;		// added to the positions stored in the arrays
   const int before_size;	// bytes to keep in buffer before dictionary
+  const int after_size_;	// bytes to keep in buffer after pos
+  const int dict_size_;		// dictionary size requested
+  const int dict_factor_;	// buffer size is dict_factor_ * dict_size_
   int buffer_size;
+  int owned_size;		// size of owned_buffer
   int dictionary_size;		// bytes to keep in buffer before pos
   int pos;			// current pos in buffer
   int cyclic_pos;		// cycles through [0, dictionary_size]
@@ -182,18 +218,28 @@ protected:
   int pos_limit;		// when reached, a new block must be read
   int key4_mask;
   const int num_prev_positions23;
+  const int pos_array_factor_;
   int num_prev_positions;	// size of prev_positions
   int pos_array_size;
-  const int infd;		// input file descriptor
+  unsigned prev_size;		// allocated size of prev_positions + pos_array
+  Data_source * isrc;		// source of input data
   bool at_stream_end;		// stream_pos shows real end of file
+  bool external_buffer;		// buffer belongs to isrc; never written
 
   Matchfinder_base( const int before_size_,
                     const int dict_size, const int after_size,
                     const int dict_factor, const int num_prev_positions23_,
-                    const int pos_array_factor, const int ifd );
+                    const int pos_array_factor, Data_source & src );
 
-  ~Matchfinder_base()
-    { delete[] prev_positions; std::free( buffer ); }
+  static unsigned hash_size( const int dictionary_size );
+  // bytes allocated at most by a matchfinder with these parameters
+  static unsigned long long memory_needed( const int before_size,
+    const int dict_size, const int after_size, const int dict_factor,
+    const int num_prev_positions23, const int pos_array_factor );
+
+  ~Matchfinder_base() { free_arrays(); }
+
+  void init( Data_source & src );
 
 public:
   uint8_t peek( const int distance ) const { return buffer[pos-distance]; }
@@ -201,14 +247,15 @@ public:
   unsigned long long data_position() const { return partial_data_pos + pos; }
   bool data_finished() const { return at_stream_end && pos >= stream_pos; }
   const uint8_t * ptr_to_current_pos() const { return buffer + pos; }
+  // bytes allocated by the matchfinder
+  unsigned long long memory_size() const
+    { return owned_size +
+             (unsigned long long)prev_size * sizeof prev_positions[0]; }
 
   int true_match_len( const int index, const int distance ) const
     {
-    const uint8_t * const data = buffer + pos;
-    int i = index;
     const int len_limit = std::min( available_bytes(), (int)max_match_len );
-    while( i < len_limit && data[i-distance] == data[i] ) ++i;
-    return i;
+    return match_len( buffer + pos, distance, index, len_limit );
     }
 
   void move_pos()
@@ -230,7 +277,7 @@ class Range_encoder
   int pos;			// current pos in buffer
   uint32_t range;
   unsigned ff_count;
-  const int outfd;		// output file descriptor
+  Data_sink * osnk;		// destination of output data
   uint8_t cache;
   Lzip_header header;
 
@@ -263,9 +310,9 @@ public:
     for( int i = 0; i < header.size; ++i ) put_byte( header.data[i] );
     }
 
-  Range_encoder( const unsigned dictionary_size, const int ofd )
+  Range_encoder( const unsigned dictionary_size, Data_sink & snk )
     :
-    buffer( new uint8_t[buffer_size] ), outfd( ofd )
+    buffer( new uint8_t[buffer_size] ), osnk( &snk )
     {
     header.set_magic();
     reset( dictionary_size );
@@ -273,6 +320,8 @@ public:
 
   ~Range_encoder() { delete[] buffer; }
 
+  void set_sink( Data_sink & snk ) { osnk = &snk; }
+
   unsigned long long member_position() const
     { return partial_member_pos + pos + ff_count; }
 
@@ -395,38 +444,26 @@ public:
   };
 
 
-class LZ_encoder_base : public Matchfinder_base
+// the probability models are inherited from Lzma_model
+class LZ_encoder_base : public Matchfinder_base, protected Lzma_model
   {
 protected:
   enum { max_marker_size = 16,
          num_rep_distances = 4 };	// must be 4
 
   uint32_t crc_;
-
-  Bit_model bm_literal[1<<literal_context_bits][0x300];
-  Bit_model bm_match[State::states][pos_states];
-  Bit_model bm_rep[State::states];
-  Bit_model bm_rep0[State::states];
-  Bit_model bm_rep1[State::states];
-  Bit_model bm_rep2[State::states];
-  Bit_model bm_len[State::states][pos_states];
-  Bit_model bm_dis_slot[len_states][1<<dis_slot_bits];
-  Bit_model bm_dis[modeled_distances-end_dis_model+1];
-  Bit_model bm_align[dis_align_size];
-  Len_model match_len_model;
-  Len_model rep_len_model;
   Range_encoder renc;
 
   LZ_encoder_base( const int before_size, const int dict_size,
                    const int after_size, const int dict_factor,
                    const int num_prev_positions23,
                    const int pos_array_factor,
-                   const int ifd, const int outfd )
+                   Data_source & src, Data_sink & snk )
     :
     Matchfinder_base( before_size, dict_size, after_size, dict_factor,
-                      num_prev_positions23, pos_array_factor, ifd ),
+                      num_prev_positions23, pos_array_factor, src ),
     crc_( 0xFFFFFFFFU ),
-    renc( dictionary_size, outfd )
+    renc( dictionary_size, snk )
     {}
 
   unsigned crc() const { return crc_ ^ 0xFFFFFFFFU; }
@@ -470,6 +507,25 @@ protected:
       }
     }
 
+  /* Data that the encoder compresses by less than 1/32 every probe_size
+     bytes are encoded as literals, without searching for matches, in runs
+     of increasing length. A run ends early if the literals alone reduce
+     the size of a chunk by at least 1/16. */
+  struct Literal_probe
+    {
+    enum { probe_size = 1 << 16, min_run = 1 << 16, max_run = 1 << 22,
+           chunk_size = 1 << 12 };
+    unsigned long long dpos;		// data position of probe
+    unsigned long long mpos;		// member position of probe
+    int run;				// length of next run of literals
+
+    Literal_probe()
+      : dpos( 0 ), mpos( Lzip_header::size ), run( min_run ) {}
+    };
+
+  int encode_literal_run( Literal_probe & probe, State & state,
+                          const int rep0,
+                          const unsigned long long member_size_limit );
   void full_flush( const State state );
 
 public:
@@ -478,5 +534,8 @@ public:
   unsigned long long member_position() const { return renc.member_position(); }
   virtual void reset();
 
+  // start a new stream, reusing the memory allocated for the previous one
+  virtual void reset_stream( Data_source & src, Data_sink & snk );
+
   virtual bool encode_member( const unsigned long long member_size ) = 0;
   };
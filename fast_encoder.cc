@@ -32,13 +32,14 @@
 
 int FLZ_encoder::longest_match_len( int * const distance )
   {
+  STATS_TIMER( st_match );
   enum { len_limit = 16 };
   const int available = std::min( available_bytes(), (int)max_match_len );
   if( available < len_limit ) return 0;
 
   const uint8_t * const data = ptr_to_current_pos();
   key4 = ( ( key4 << 4 ) ^ data[3] ) & key4_mask;
-  const int pos1 = pos + 1;
+  const int pos1 = pos_offset + pos + 1;
   int newpos1 = prev_positions[key4];
   prev_positions[key4] = pos1;
   int32_t * ptr0 = pos_array + cyclic_pos;
@@ -47,7 +48,7 @@ int FLZ_encoder::longest_match_len( int * const distance )
   for( int count = 4; ; )
     {
     int delta;
-    if( newpos1 <= 0 || --count < 0 ||
+    if( newpos1 <= pos_offset || --count < 0 ||
         ( delta = pos1 - newpos1 ) > dictionary_size ) { *ptr0 = 0; break; }
     int32_t * const newptr = pos_array +
       ( cyclic_pos - delta +
@@ -55,8 +56,7 @@ int FLZ_encoder::longest_match_len( int * const distance )
 
     if( data[maxlen-delta] == data[maxlen] )
       {
-      int len = 0;
-      while( len < available && data[len-delta] == data[len] ) ++len;
+      const int len = match_len( data, delta, 0, available );
       if( maxlen < len )
         { maxlen = len; *distance = delta - 1;
           if( maxlen >= len_limit ) { *ptr0 = *newptr; break; } }
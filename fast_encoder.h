@@ -36,7 +36,7 @@ class FLZ_encoder : public LZ_encoder_base
         {
         key4 = ( ( key4 << 4 ) ^ buffer[pos+3] ) & key4_mask;
         pos_array[cyclic_pos] = prev_positions[key4];
-        prev_positions[key4] = pos + 1;
+        prev_positions[key4] = pos_offset + pos + 1;
         }
       move_pos();
       }
@@ -51,10 +51,15 @@ class FLZ_encoder : public LZ_encoder_base
          pos_array_factor = 1 };
 
 public:
-  FLZ_encoder( const int ifd, const int outfd )
+  static unsigned long long memory_needed()
+    { return sizeof (FLZ_encoder) + Matchfinder_base::memory_needed(
+        before_size, dict_size, after_size, dict_factor,
+        num_prev_positions23, pos_array_factor ); }
+
+  FLZ_encoder( Data_source & src, Data_sink & snk )
     :
     LZ_encoder_base( before_size, dict_size, after_size, dict_factor,
-                     num_prev_positions23, pos_array_factor, ifd, outfd )
+                     num_prev_positions23, pos_array_factor, src, snk )
     {}
 
   bool encode_member( const unsigned long long member_size );
@@ -0,0 +1,240 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "lzip.h"
+#include "encoder_base.h"
+#include "hc_encoder.h"
+
+
+namespace {
+
+/* Cheap estimate of the gain of a sequence, in units of 1/4 of a byte.
+   Each byte coded is worth 4 units, and a match pays for the bits of its
+   distance. Repeated matches pay nothing for their distances. */
+inline int gain( const int len, const int dis4 )
+  {
+  if( dis4 < 4 ) return 4 * len;
+  return 4 * len - real_bits( dis4 - 3 );
+  }
+
+} // end namespace
+
+
+int HC_encoder::longest_match_len( int * const distance )
+  {
+  STATS_TIMER( st_match );
+  const int available = std::min( available_bytes(), (int)max_match_len );
+  if( available < 4 ) return 0;
+
+  const uint8_t * const data = ptr_to_current_pos();
+  const int key = key4();
+  const int min_pos = pos_offset +
+                      ( ( pos > dictionary_size ) ? pos - dictionary_size : 0 );
+  const int pos1 = pos_offset + pos + 1;
+  int newpos1 = prev_positions[key];
+  prev_positions[key] = pos1;
+  pos_array[cyclic_pos] = newpos1;
+  int maxlen = 0;
+
+  for( int count = cycles; newpos1 > min_pos && --count >= 0; )
+    {
+    const int delta = pos1 - newpos1;
+    // load the next link of the chain while the bytes are compared
+    newpos1 = pos_array[cyclic_pos - delta +
+                        ( ( cyclic_pos >= delta ) ? 0 : dictionary_size + 1 )];
+    if( data[maxlen-delta] == data[maxlen] )
+      {
+      const int len = match_len( data, delta, 0, available );
+      if( maxlen < len )
+        { maxlen = len; *distance = delta - 1;
+          if( maxlen >= match_len_limit || maxlen >= available ) break; }
+      }
+    }
+  return maxlen;
+  }
+
+
+/* Set len and dis4 to the best sequence starting at the current pos, or
+   len to 0 if a literal is preferable. dis4 is the index of a repeated
+   distance, or a match distance + 4. */
+void HC_encoder::find_sequence( const int reps[num_rep_distances],
+                                int & len, int & dis4 )
+  {
+  int match_distance = 0;
+  const int main_len = longest_match_len( &match_distance );
+  int rep_len = 0, rep = 0;
+  for( int i = 0; i < num_rep_distances; ++i )
+    {
+    const int tlen = true_match_len( 0, reps[i] + 1 );
+    if( tlen > rep_len ) { rep_len = tlen; rep = i; }
+    }
+  len = 0;
+  if( rep_len >= min_match_len &&
+      gain( rep_len, rep ) + 4 >= gain( main_len, match_distance + 4 ) )
+    { len = rep_len; dis4 = rep; }
+  // a short match with a long distance costs more than its literals
+  else if( main_len > min_match_len + ( match_distance >= 1 << 12 ) )
+    { len = main_len; dis4 = match_distance + num_rep_distances; }
+  }
+
+
+void HC_encoder::encode_sequence( const uint8_t * const data, const int len,
+                                  const int dis4, const int pos_state,
+                                  State & state, int reps[num_rep_distances] )
+  {
+  crc32.update_buf( crc_, data, len );
+  renc.encode_bit( bm_match[state()][pos_state], 1 );
+  if( dis4 >= num_rep_distances )			// match
+    {
+    renc.encode_bit( bm_rep[state()], 0 );
+    state.set_match();
+    const int distance = dis4 - num_rep_distances;
+    for( int i = num_rep_distances - 1; i > 0; --i ) reps[i] = reps[i-1];
+    reps[0] = distance;
+    encode_pair( distance, len, pos_state );
+    return;
+    }
+  const int rep = dis4;					// repeated match
+  renc.encode_bit( bm_rep[state()], 1 );
+  renc.encode_bit( bm_rep0[state()], rep != 0 );
+  if( rep == 0 )
+    renc.encode_bit( bm_len[state()][pos_state], 1 );
+  else
+    {
+    renc.encode_bit( bm_rep1[state()], rep > 1 );
+    if( rep > 1 )
+      renc.encode_bit( bm_rep2[state()], rep > 2 );
+    const int distance = reps[rep];
+    for( int i = rep; i > 0; --i ) reps[i] = reps[i-1];
+    reps[0] = distance;
+    }
+  state.set_rep();
+  renc.encode_len( rep_len_model, len, pos_state );
+  }
+
+
+// encode cur_byte as a literal, or as a short rep if cheaper
+void HC_encoder::encode_byte( const uint8_t prev_byte, const uint8_t cur_byte,
+                              const uint8_t match_byte, const int pos_state,
+                              State & state )
+  {
+  crc32.update_byte( crc_, cur_byte );
+  if( match_byte == cur_byte )
+    {
+    const int shortrep_price = price1( bm_match[state()][pos_state] ) +
+                               price1( bm_rep[state()] ) +
+                               price0( bm_rep0[state()] ) +
+                               price0( bm_len[state()][pos_state] );
+    int price = price0( bm_match[state()][pos_state] );
+    if( state.is_char() )
+      price += price_literal( prev_byte, cur_byte );
+    else
+      price += price_matched( prev_byte, cur_byte, match_byte );
+    if( shortrep_price < price )
+      {
+      renc.encode_bit( bm_match[state()][pos_state], 1 );
+      renc.encode_bit( bm_rep[state()], 1 );
+      renc.encode_bit( bm_rep0[state()], 0 );
+      renc.encode_bit( bm_len[state()][pos_state], 0 );
+      state.set_shortrep();
+      return;
+      }
+    }
+  renc.encode_bit( bm_match[state()][pos_state], 0 );
+  if( state.is_char_set_char() )
+    encode_literal( prev_byte, cur_byte );
+  else
+    encode_matched( prev_byte, cur_byte, match_byte );
+  }
+
+
+bool HC_encoder::encode_member( const unsigned long long member_size )
+  {
+  const unsigned long long member_size_limit =
+    member_size - Lzip_trailer::size - max_marker_size;
+  int reps[num_rep_distances];
+  State state;
+  for( int i = 0; i < num_rep_distances; ++i ) reps[i] = 0;
+  Literal_probe probe;		// detection of incompressible data
+
+  if( data_position() != 0 || renc.member_position() != Lzip_header::size )
+    return false;				// can be called only once
+
+  if( !data_finished() )			// encode first byte
+    {
+    const uint8_t prev_byte = 0;
+    const uint8_t cur_byte = peek( 0 );
+    renc.encode_bit( bm_match[state()][0], 0 );
+    encode_literal( prev_byte, cur_byte );
+    crc32.update_byte( crc_, cur_byte );
+    update_and_move( 1 );
+    }
+
+  int len = 0, dis4 = 0;
+  bool pending = false;		// len and dis4 already found for this pos
+  while( !data_finished() && renc.member_position() < member_size_limit )
+    {
+    const int lr = encode_literal_run( probe, state, reps[0],
+                                       member_size_limit );
+    if( lr == 2 ) return true;			// member full
+    if( lr == 1 ) { pending = false; continue; }
+    if( !pending ) find_sequence( reps, len, dis4 );
+    pending = false;
+    const int pos_state = data_position() & pos_state_mask;
+    const uint8_t prev_byte = peek( 1 );
+    const uint8_t cur_byte = peek( 0 );
+    const uint8_t match_byte = peek( reps[0] + 1 );
+    move_pos();
+
+    if( len <= 0 )				// literal byte
+      { encode_byte( prev_byte, cur_byte, match_byte, pos_state, state );
+        continue; }
+
+    if( len < lazy_limit && available_bytes() > len )
+      {			// lazy matching; try the sequence at the next pos
+      int len2, dis42;
+      find_sequence( reps, len2, dis42 );
+      if( len2 > 0 && gain( len2, dis42 ) > gain( len, dis4 ) + 4 )
+        {
+        encode_byte( prev_byte, cur_byte, match_byte, pos_state, state );
+        len = len2; dis4 = dis42; pending = true;
+        continue;
+        }
+      encode_sequence( ptr_to_current_pos() - 1, len, dis4, pos_state,
+                       state, reps );
+      move_pos();
+      update_and_move( len - 2 );
+      continue;
+      }
+    encode_sequence( ptr_to_current_pos() - 1, len, dis4, pos_state,
+                     state, reps );
+    update_and_move( len - 1 );
+    }
+
+  full_flush( state );
+  return true;
+  }
@@ -0,0 +1,86 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Encoder of the levels of '--fast=<n>'. It finds matches with a hash
+   chain of limited depth and parses them with one step lazy matching,
+   which is much faster than the optimal parser of LZ_encoder and, unlike
+   FLZ_encoder, works with dictionaries of any size. The depth of the
+   chain and the longest match tried lazily grow with the match length
+   limit, so that the levels with shorter limits search less. */
+class HC_encoder : public LZ_encoder_base
+  {
+  const int cycles;		// max number of positions tried per search
+  const int match_len_limit;	// longer matches end the search
+  const int lazy_limit;		// shorter matches are tried at the next pos
+
+  int key4() const
+    {
+    const uint8_t * const data = ptr_to_current_pos();
+    const unsigned tmp = crc32[data[0]] ^ data[1] ^ ( (unsigned)data[2] << 8 );
+    return ( tmp ^ ( crc32[data[3]] << 5 ) ) & key4_mask;
+    }
+
+  int longest_match_len( int * const distance );
+  void find_sequence( const int reps[num_rep_distances],
+                      int & len, int & dis4 );
+
+  void update_and_move( int n )
+    {
+    while( --n >= 0 )
+      {
+      if( available_bytes() >= 4 )
+        {
+        const int key = key4();
+        pos_array[cyclic_pos] = prev_positions[key];
+        prev_positions[key] = pos_offset + pos + 1;
+        }
+      move_pos();
+      }
+    }
+
+  void encode_sequence( const uint8_t * const data, const int len,
+                        const int dis4, const int pos_state, State & state,
+                        int reps[num_rep_distances] );
+  void encode_byte( const uint8_t prev_byte, const uint8_t cur_byte,
+                    const uint8_t match_byte, const int pos_state,
+                    State & state );
+
+  enum { before_size = 0,
+         // bytes to keep in buffer after pos
+         after_size = max_match_len,
+         dict_factor = 2,
+         num_prev_positions23 = 0,
+         pos_array_factor = 1 };
+
+public:
+  static unsigned long long memory_needed( const int dict_size )
+    { return sizeof (HC_encoder) + Matchfinder_base::memory_needed(
+        before_size, dict_size, after_size, dict_factor,
+        num_prev_positions23, pos_array_factor ); }
+
+  HC_encoder( const int dict_size, const int len_limit,
+              Data_source & src, Data_sink & snk )
+    :
+    LZ_encoder_base( before_size, dict_size, after_size, dict_factor,
+                     num_prev_positions23, pos_array_factor, src, snk ),
+    cycles( std::max( 1, len_limit / 8 ) ),
+    match_len_limit( len_limit ),
+    lazy_limit( len_limit / 2 )
+    {}
+
+  bool encode_member( const unsigned long long member_size );
+  };
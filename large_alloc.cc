@@ -0,0 +1,105 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   Allocation of the large arrays of the encoders and decoders (the
+   dictionary buffers and the hash chains or trees). Where available,
+   these arrays are backed by huge pages to reduce the TLB misses caused
+   by their random access pattern. Explicit huge pages (MAP_HUGETLB) are
+   tried first, then transparent huge pages (MADV_HUGEPAGE); if neither
+   is available, normal pages are used. As the memory is first touched
+   by the thread that uses it, it is placed in the NUMA node of that
+   thread by the default first-touch policy of the kernel.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#if defined __linux__
+#include <sys/mman.h>
+#endif
+
+#include "lzip.h"
+
+
+#if defined __linux__ && defined MADV_HUGEPAGE
+
+namespace {
+
+enum { huge_page_size = 1 << 21 };	// 2 MiB; smaller blocks use malloc
+
+unsigned long mapped_size( const unsigned long size )
+  { return ( size + huge_page_size - 1 ) & ~( huge_page_size - 1UL ); }
+
+} // end namespace
+
+
+void * large_alloc( const unsigned long size )
+  {
+  if( size < huge_page_size ) return std::malloc( size );
+  const unsigned long msize = mapped_size( size );
+  const int prot = PROT_READ | PROT_WRITE;
+  const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void * p;
+#ifdef MAP_HUGETLB
+  p = mmap( 0, msize, prot, flags | MAP_HUGETLB, -1, 0 );
+  if( p != MAP_FAILED ) return p;
+#endif
+  // map one extra huge page and trim the ends to align the block
+  p = mmap( 0, msize + huge_page_size, prot, flags, -1, 0 );
+  if( p == MAP_FAILED ) return 0;
+  uint8_t * const base = (uint8_t *)p;
+  const unsigned long head = ( huge_page_size -
+    ( (uintptr_t)base & ( huge_page_size - 1 ) ) ) & ( huge_page_size - 1 );
+  if( head > 0 ) munmap( base, head );
+  munmap( base + head + msize, huge_page_size - head );
+  madvise( base + head, msize, MADV_HUGEPAGE );	// ignore failure
+  return base + head;
+  }
+
+
+void large_free( void * const p, const unsigned long size )
+  {
+  if( !p ) return;
+  if( size < huge_page_size ) std::free( p );
+  else munmap( p, mapped_size( size ) );
+  }
+
+#else
+
+void * large_alloc( const unsigned long size ) { return std::malloc( size ); }
+
+void large_free( void * const p, const unsigned long ) { std::free( p ); }
+
+#endif
+
+
+/* Like realloc, but the block must have been allocated by large_alloc
+   with size old_size. Returns 0 and leaves the block alone on failure. */
+void * large_realloc( void * const p, const unsigned long old_size,
+                      const unsigned long new_size )
+  {
+  void * const q = large_alloc( new_size );
+  if( q && p )
+    { std::memcpy( q, p, std::min( old_size, new_size ) );
+      large_free( p, old_size ); }
+  return q;
+  }
@@ -17,21 +17,157 @@
 
 #define _FILE_OFFSET_BITS 64
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
+#include <new>
 #include <string>
 #include <vector>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "lzip.h"
+#include "common_mutex.h"
 #include "lzip_index.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 
 namespace {
 
+extern "C" void * index_worker( void * arg );
+
+/* Index the files in parallel. The workers open and index the files in
+   order, at most 'max_ahead' files ahead of the file being listed, and
+   never print anything. Any file that a worker can't open or index is
+   left to the listing loop, which repeats the work and reports the error.
+   So the output does not depend on the number of workers. */
+class Index_pool
+  {
+  const std::vector< std::string > & filenames;
+  const Cl_options & cl_opts;
+  std::vector< const Lzip_index * > indexes;	// 0 if not indexed
+  std::vector< bool > done;
+  std::vector< pthread_t > workers;
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;	// a file was indexed or one was taken
+  unsigned next;		// next file to be indexed
+  unsigned taken;		// files taken by the listing loop
+  const unsigned max_ahead;
+  bool stop;
+
+  Index_pool( const Index_pool & );		// declared as private
+  void operator=( const Index_pool & );		// declared as private
+  friend void * index_worker( void * arg );
+
+  // index without messages; return 0 on error
+  const Lzip_index * index_file( const unsigned i ) const
+    {
+    if( filenames[i] == "-" ) return 0;
+    const char * const name = filenames[i].c_str();
+    const int infd = open( name, O_RDONLY | O_BINARY );
+    if( infd < 0 ) return 0;
+    struct stat st;
+    const Lzip_index * lzip_indexp = 0;
+    if( fstat( infd, &st ) == 0 && S_ISREG( st.st_mode ) )
+      {
+      try { lzip_indexp = new Lzip_index( infd, cl_opts, name ); }
+      catch( std::bad_alloc & ) {}
+      if( lzip_indexp && lzip_indexp->retval() != 0 )
+        { delete lzip_indexp; lzip_indexp = 0; }
+      }
+    close( infd );
+    return lzip_indexp;
+    }
+
+public:
+  Index_pool( const std::vector< std::string > & filenames_,
+              const Cl_options & cl_opts_, const int num_workers )
+    : filenames( filenames_ ), cl_opts( cl_opts_ ),
+      indexes( filenames.size(), (const Lzip_index *)0 ),
+      done( filenames.size(), false ), next( 0 ), taken( 0 ),
+      max_ahead( 4 * num_workers ), stop( false )
+    {
+    xinit_mutex( &mutex ); xinit_cond( &changed );
+    for( int i = 0; i < num_workers; ++i )
+      {
+      pthread_t thread;
+      const int errcode = pthread_create( &thread, 0, index_worker, this );
+      if( errcode )
+        { show_error( "Can't create worker threads", errcode );
+          cleanup_and_fail( 1 ); }
+      workers.push_back( thread );
+      }
+    }
+
+  ~Index_pool()
+    {
+    xlock( &mutex ); stop = true; xbroadcast( &changed ); xunlock( &mutex );
+    for( unsigned i = 0; i < workers.size(); ++i )
+      {
+      const int errcode = pthread_join( workers[i], 0 );
+      if( errcode )
+        { show_error( "Can't join worker threads", errcode );
+          cleanup_and_fail( 1 ); }
+      }
+    for( unsigned i = 0; i < indexes.size(); ++i ) delete indexes[i];
+    xdestroy_cond( &changed ); xdestroy_mutex( &mutex );
+    }
+
+  /* Wait until file i has been indexed and return its index, or 0 if the
+     file must be indexed by the caller. The caller owns the index. */
+  const Lzip_index * take( const unsigned i )
+    {
+    xlock( &mutex );
+    while( !done[i] ) xwait( &changed, &mutex );
+    const Lzip_index * const lzip_indexp = indexes[i];
+    indexes[i] = 0;
+    taken = i + 1;
+    xbroadcast( &changed );
+    xunlock( &mutex );
+    return lzip_indexp;
+    }
+  };
+
+
+struct Index_deleter		// deletes the index at the end of its scope
+  {
+  const Lzip_index * const p;
+  ~Index_deleter() { delete p; }
+  };
+
+
+// index files until all are indexed or the pool is stopped
+extern "C" void * index_worker( void * arg )
+  {
+  Index_pool & pool = *(Index_pool *)arg;
+  while( true )
+    {
+    xlock( &pool.mutex );
+    while( !pool.stop && pool.next < pool.filenames.size() &&
+           pool.next >= pool.taken + pool.max_ahead )
+      xwait( &pool.changed, &pool.mutex );
+    const unsigned i = pool.next;
+    const bool finished = pool.stop || i >= pool.filenames.size();
+    if( !finished ) ++pool.next;
+    xunlock( &pool.mutex );
+    if( finished ) break;
+    const Lzip_index * const lzip_indexp = pool.index_file( i );
+    xlock( &pool.mutex );
+    pool.indexes[i] = lzip_indexp; pool.done[i] = true;
+    xbroadcast( &pool.changed );
+    xunlock( &pool.mutex );
+    }
+  return 0;
+  }
+
+
 void list_line( const unsigned long long uncomp_size,
                 const unsigned long long comp_size,
                 const char * const input_filename )
@@ -49,32 +185,47 @@ void list_line( const unsigned long long uncomp_size,
 
 
 int list_files( const std::vector< std::string > & filenames,
-                const Cl_options & cl_opts )
+                const Cl_options & cl_opts, const int num_workers )
   {
   unsigned long long total_comp = 0, total_uncomp = 0;
   int files = 0, retval = 0;
   bool first_post = true;
   bool stdin_used = false;
+  Index_pool * const pool = ( num_workers > 1 && filenames.size() > 1 ) ?
+    new Index_pool( filenames, cl_opts,
+                    std::min( num_workers, (int)filenames.size() ) ) : 0;
 
   for( unsigned i = 0; i < filenames.size(); ++i )
     {
+    // take every file, even if skipped, so that the workers can go ahead
+    const Lzip_index * lzip_indexp = pool ? pool->take( i ) : 0;
     const bool from_stdin = filenames[i] == "-";
     if( from_stdin ) { if( stdin_used ) continue; else stdin_used = true; }
     const char * const input_filename =
       from_stdin ? "(stdin)" : filenames[i].c_str();
-    struct stat in_stats;				// not used
-    const int infd = from_stdin ? STDIN_FILENO :
-      open_instream( input_filename, &in_stats, false, true );
-    if( infd < 0 ) { set_retval( retval, 1 ); continue; }
-
-    const Lzip_index lzip_index( infd, cl_opts );
-    close( infd );
+    if( !lzip_indexp )
+      {
+      struct stat in_stats;				// not used
+      const int infd = from_stdin ? STDIN_FILENO :
+        open_instream( input_filename, &in_stats, false, true );
+      if( infd < 0 ) { set_retval( retval, 1 ); continue; }
+      lzip_indexp = new Lzip_index( infd, cl_opts,
+                                    from_stdin ? 0 : input_filename );
+      close( infd );
+      }
+    const Index_deleter deleter = { lzip_indexp };
+    const Lzip_index & lzip_index = *lzip_indexp;
     if( lzip_index.retval() != 0 )
       {
       show_file_error( input_filename, lzip_index.error().c_str() );
       set_retval( retval, lzip_index.retval() );
       continue;
       }
+    if( cl_opts.make_index && !from_stdin && !lzip_index.from_sidecar() &&
+        !lzip_index.write_sidecar( input_filename ) )
+      { show_file_error( sidecar_name( input_filename ).c_str(),
+                         "Can't write index file", errno );
+        set_retval( retval, 1 ); }
     const bool multi_empty = !from_stdin && lzip_index.multi_empty();
     if( multi_empty ) set_retval( retval, 2 );
     if( verbosity < 0 ) continue;
@@ -110,6 +261,7 @@ int list_files( const std::vector< std::string > & filenames,
     std::fflush( stdout );
     if( std::ferror( stdout ) ) break;
     }
+  delete pool;
   if( verbosity >= 0 && files > 1 && !std::ferror( stdout ) )
     {
     if( verbosity >= 1 ) std::fputs( "                      ", stdout );
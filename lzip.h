@@ -109,6 +109,36 @@ struct Len_model
   };
 
 
+/* All the probability models of a member, in one block. The models used by
+   every symbol come first, then those of lengths and distances, and the
+   large literal coder at the end, so that the hot models share as few cache
+   lines as possible. The block contains only Bit_models, and is reset with
+   a single loop. The block is not declared aligned because the encoders,
+   which inherit it, are allocated with plain new. */
+struct Lzma_model
+  {
+  Bit_model bm_match[State::states][pos_states];
+  Bit_model bm_rep[State::states];
+  Bit_model bm_rep0[State::states];
+  Bit_model bm_rep1[State::states];
+  Bit_model bm_rep2[State::states];
+  Bit_model bm_len[State::states][pos_states];
+  Len_model match_len_model;
+  Len_model rep_len_model;
+  Bit_model bm_dis_slot[len_states][1<<dis_slot_bits];
+  Bit_model bm_align[dis_align_size];
+  Bit_model bm_dis[modeled_distances-end_dis_model+1];
+  Bit_model bm_literal[1<<literal_context_bits][0x300];
+
+  void reset()
+    {
+    const Bit_model * const end = bm_literal[0] +
+                                  ( 1 << literal_context_bits ) * 0x300;
+    bm_match[0][0].reset( end - bm_match[0] );
+    }
+  };
+
+
 // defined in main.cc
 extern int verbosity;
 
@@ -151,10 +181,46 @@ public:
   };
 
 
-class CRC32
+#ifdef ENABLE_STATS
+/* Statistics of the hot paths, compiled in with 'configure --enable-stats'.
+   Phases may be nested; for example, parsing includes match finding. */
+enum Stats_phase { st_match, st_parse, st_dis_prices, st_len_prices,
+                   st_align_prices, st_encode, st_decode, st_crc, st_read,
+                   st_write, num_stats_phases };
+enum { num_len_buckets = 10 };		// 1, 2, 3, 4, 5-8, ..., 129-273
+
+// defined in stats.cc
+unsigned long long stats_ticks();
+void stats_add( const Stats_phase phase, const unsigned long long ticks,
+                const unsigned long long bytes, const unsigned long syscalls );
+void stats_sequence( const int len, const bool rep );	// len 0 = literal
+void show_stats();
+
+class Stats_timer		// adds the time it has lived to phase
   {
-  uint32_t data[256];		// Table of CRCs of all 8-bit messages.
+  const Stats_phase phase;
+  const unsigned long long start;
+public:
+  unsigned long long bytes;
+  unsigned long syscalls;
+
+  explicit Stats_timer( const Stats_phase p )
+    : phase( p ), start( stats_ticks() ), bytes( 0 ), syscalls( 0 ) {}
+  ~Stats_timer() { stats_add( phase, stats_ticks() - start, bytes, syscalls ); }
+  };
+
+#define STATS_TIMER( phase ) Stats_timer stats_timer( phase )
+#define STATS( x ) x
+#else
+#define STATS_TIMER( phase )
+#define STATS( x )
+#endif
 
+
+class CRC32
+  {
+  uint32_t data[8][256];	// Tables of CRCs for slice-by-8.
+				// data[0] is the CRC of all 8-bit messages.
 public:
   CRC32()
     {
@@ -163,22 +229,36 @@ public:
       unsigned c = n;
       for( int k = 0; k < 8; ++k )
         { if( c & 1 ) c = 0xEDB88320U ^ ( c >> 1 ); else c >>= 1; }
-      data[n] = c;
+      data[0][n] = c;
       }
+    for( unsigned n = 0; n < 256; ++n )
+      for( int k = 1; k < 8; ++k )
+        data[k][n] = data[0][data[k-1][n]&0xFF] ^ ( data[k-1][n] >> 8 );
     }
 
-  uint32_t operator[]( const uint8_t byte ) const { return data[byte]; }
+  uint32_t operator[]( const uint8_t byte ) const { return data[0][byte]; }
 
   void update_byte( uint32_t & crc, const uint8_t byte ) const
-    { crc = data[(crc^byte)&0xFF] ^ ( crc >> 8 ); }
+    { crc = data[0][(crc^byte)&0xFF] ^ ( crc >> 8 ); }
 
-  // about as fast as it is possible without messing with endianness
+  /* Process 8 bytes per iteration (slice-by-8). The bytes are combined
+     explicitly, so the result does not depend on the endianness. */
   void update_buf( uint32_t & crc, const uint8_t * const buffer,
                    const int size ) const
     {
+    STATS_TIMER( st_crc ); STATS( stats_timer.bytes = size );
     uint32_t c = crc;
-    for( int i = 0; i < size; ++i )
-      c = data[(c^buffer[i])&0xFF] ^ ( c >> 8 );
+    int i = 0;
+    for( ; i + 8 <= size; i += 8 )
+      {
+      const uint8_t * const p = buffer + i;
+      c ^= p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+      c = data[7][c&0xFF] ^ data[6][(c>>8)&0xFF] ^ data[5][(c>>16)&0xFF] ^
+          data[4][c>>24] ^ data[3][p[4]] ^ data[2][p[5]] ^ data[1][p[6]] ^
+          data[0][p[7]];
+      }
+    for( ; i < size; ++i )
+      c = data[0][(c^buffer[i])&0xFF] ^ ( c >> 8 );
     crc = c;
     }
   };
@@ -315,8 +395,21 @@ struct Cl_options		// command-line options
   {
   bool ignore_trailing;
   bool loose_trailing;
+  bool make_index;		// write sidecar index files
+  bool recover;			// index the intact members of damaged files
+  bool sparse;			// leave holes for zero blocks when decompressing
+
+  Cl_options()
+    : ignore_trailing( true ), loose_trailing( false ), make_index( false ),
+      recover( false ), sparse( false ) {}
+  };
+
 
-  Cl_options() : ignore_trailing( true ), loose_trailing( false ) {}
+struct Lzma_options
+  {
+  int dictionary_size;		// 4 KiB .. 512 MiB
+  int match_len_limit;		// 5 .. 273
+  bool lazy;			// use HC_encoder (levels of '--fast=<n>')
   };
 
 
@@ -340,10 +433,332 @@ const char * const wr_err_msg = "Write error";
 // defined in decoder.cc
 int readblock( const int fd, uint8_t * const buf, const int size );
 int writeblock( const int fd, const uint8_t * const buf, const int size );
+int writeblock_sparse( const int fd, const uint8_t * const buf,
+                       const int size );
+bool sparse_ok( const int fd );
+bool finish_sparse( const int fd );
+int preadblock( const int fd, uint8_t * const buf, const int size,
+                const long long pos );
+
+// defined in large_alloc.cc
+void * large_alloc( const unsigned long size );
+void large_free( void * const p, const unsigned long size );
+void * large_realloc( void * const p, const unsigned long old_size,
+                      const unsigned long new_size );
+
+
+// positions in the input buffer of the matchfinder must fit in an int
+enum { max_contents_size = 0x7FFFFFFF - 0x10000 };
+
+/* Input and output of the encoders and decoders. 'read' behaves like
+   readblock and 'write' behaves like writeblock, but data may come from
+   (or go to) memory instead of a file descriptor. */
+class Data_source
+  {
+public:
+  virtual int read( uint8_t * const buf, const int size ) = 0;
+
+  /* If all the remaining data are already in memory, consume them and
+     return a pointer to them and their size (0 < size <= max_contents_size).
+     Else return 0. The data must stay valid while the source exists. */
+  virtual const uint8_t * contents( int & size ) { size = 0; return 0; }
+
+  /* Tell the source that the contents before 'end' won't be read again,
+     so that their memory may be released. */
+  virtual void discard( const uint8_t * const ) {}
+
+  virtual ~Data_source() {}
+  };
+
+class Data_sink
+  {
+public:
+  virtual int write( const uint8_t * const buf, const int size ) = 0;
+  virtual ~Data_sink() {}
+  };
+
+
+class Fd_source : public Data_source
+  {
+protected:
+  const int fd;
+
+public:
+  explicit Fd_source( const int ifd ) : fd( ifd ) {}
+  int read( uint8_t * const buf, const int size )
+    { return readblock( fd, buf, size ); }
+  };
+
+class Fd_sink : public Data_sink		// discards data if fd < 0
+  {
+  const int fd;
+  const bool sparse;		// write with writeblock_sparse
+
+public:
+  explicit Fd_sink( const int ofd, const bool sp = false )
+    : fd( ofd ), sparse( sp ) {}
+  int write( const uint8_t * const buf, const int size )
+    {
+    if( fd < 0 ) return size;
+    return sparse ? writeblock_sparse( fd, buf, size ) :
+                    writeblock( fd, buf, size );
+    }
+  };
+
+
+// defined in async_io.cc
+struct Block_queue;
+
+/* Reads fd in a separate thread, some blocks ahead of the coder. The
+   thread is started by the first read. */
+class Async_source : public Data_source
+  {
+  const int fd;
+  Block_queue * queue;
+  uint8_t * block;		// block being consumed, or 0
+  int bsize;			// bytes in block
+  int block_pos;		// bytes of block already consumed
+  bool at_end;			// last block taken
+
+  Async_source( const Async_source & );		// declared as private
+  void operator=( const Async_source & );	// declared as private
+
+public:
+  explicit Async_source( const int ifd )
+    : fd( ifd ), queue( 0 ), block( 0 ), bsize( 0 ), block_pos( 0 ),
+      at_end( false ) {}
+  ~Async_source();
+  int read( uint8_t * const buf, const int size );
+  };
+
+/* Writes to fd in a separate thread, started by the first write. Write
+   errors are reported by the next write or by flush, which must be
+   called at the end. Discards data if fd < 0. */
+class Async_sink : public Data_sink
+  {
+  const int fd;
+  Block_queue * queue;
+  uint8_t * block;		// block being filled, or 0
+  int block_pos;		// bytes already in block
+  const bool sparse;		// write with writeblock_sparse
+
+  Async_sink( const Async_sink & );		// declared as private
+  void operator=( const Async_sink & );		// declared as private
+
+public:
+  explicit Async_sink( const int ofd, const bool sp = false )
+    : fd( ofd ), queue( 0 ), block( 0 ), block_pos( 0 ), sparse( sp ) {}
+  ~Async_sink();
+  int write( const uint8_t * const buf, const int size );
+  bool flush();		// wait until all data are written; false if error
+  };
+
+
+/* Maps a regular file in memory if possible, making its contents available
+   without copying them. Else reads it like Fd_source. */
+class Mmap_source : public Fd_source
+  {
+  uint8_t * map;
+  long long map_size;
+  long long map_pos;		// file position of map[0], page aligned
+  long long offset;		// file position at creation
+  long long discarded;		// bytes at the start of map already discarded
+  bool used;		// contents already returned
+
+  Mmap_source( const Mmap_source & );		// declared as private
+  void operator=( const Mmap_source & );	// declared as private
+
+public:
+  // if !map, read fd like Fd_source
+  explicit Mmap_source( const int ifd, const bool map = true );
+  ~Mmap_source();
+  const uint8_t * contents( int & size );
+  void discard( const uint8_t * const end );
+  };
+
+
+class Pread_source : public Data_source	// reads a region of a file
+  {
+  const int fd;
+  long long pos;
+  long long remaining;		// bytes left in the region
+
+public:
+  Pread_source( const int ifd, const long long p, const long long s )
+    : fd( ifd ), pos( p ), remaining( s ) {}
+
+  int read( uint8_t * const buf, const int size )
+    {
+    const int sz = std::min( (long long)size, remaining );
+    const int rd = preadblock( fd, buf, sz, pos );
+    pos += rd; remaining -= rd;
+    return rd;
+    }
+  };
+
+
+class Mem_source : public Data_source
+  {
+  const uint8_t * const data;
+  const long data_size;
+  long pos;
+
+public:
+  Mem_source( const uint8_t * const d, const long s )
+    : data( d ), data_size( s ), pos( 0 ) {}
+
+  int read( uint8_t * const buf, const int size )
+    {
+    const int sz = std::min( (long)size, data_size - pos );
+    if( sz > 0 ) { std::memcpy( buf, data + pos, sz ); pos += sz; }
+    errno = 0;
+    return std::max( sz, 0 );
+    }
+
+  const uint8_t * contents( int & size )
+    {
+    size = 0;
+    if( pos >= data_size || data_size - pos > max_contents_size ) return 0;
+    size = data_size - pos; const uint8_t * const p = data + pos;
+    pos = data_size; return p;
+    }
+  };
+
+// returns first the data of a buffer, then the data from src
+class Prefix_source : public Data_source
+  {
+  const std::vector< uint8_t > & prefix;
+  Data_source & src;
+  unsigned long pos;		// position of next byte in prefix
+
+public:
+  Prefix_source( const std::vector< uint8_t > & p, Data_source & s )
+    : prefix( p ), src( s ), pos( 0 ) {}
+
+  int read( uint8_t * const buf, const int size )
+    {
+    const int sz = std::min( (unsigned long)size, prefix.size() - pos );
+    if( sz > 0 ) { std::memcpy( buf, &prefix[pos], sz ); pos += sz; }
+    errno = 0;
+    return ( sz < size ) ? sz + src.read( buf + sz, size - sz ) : sz;
+    }
+  };
+
+class Mem_sink : public Data_sink		// appends data to a vector
+  {
+  std::vector< uint8_t > & data;
+
+public:
+  explicit Mem_sink( std::vector< uint8_t > & d ) : data( d ) {}
+
+  int write( const uint8_t * const buf, const int size )
+    { data.insert( data.end(), buf, buf + size ); return size; }
+  };
+
+// defined in bench.cc
+int bench_files( const std::vector< std::string > & filenames,
+                 const Lzma_options option_mapping[],
+                 const Lzma_options fast_mapping[],
+                 const unsigned long long member_size, const bool tsv );
+struct Auto_target		// goal of option '--auto'
+  {
+  double speed;			// minimum compression speed in MB/s, or 0
+  double ratio;			// minimum compression ratio (x:1), or 0
+  };
+int auto_level( const uint8_t * const data, const long size,
+                const Lzma_options option_mapping[],
+                const Auto_target & target, const int num_workers,
+                const unsigned long long file_size,
+                const unsigned long long member_size );
+
+// defined in compress_mt.cc
+unsigned long long compress_mt_memory( const int data_size,
+                                       const Lzma_options & options,
+                                       const int num_workers, const bool zero );
+int compress_mt( const unsigned long long cfile_size,
+                 const unsigned long long member_size, const int data_size,
+                 const Lzma_options & options, const int num_workers,
+                 Data_source & src, const int outfd,
+                 const Pretty_print & pp, const bool zero,
+                 unsigned long long & in_size, unsigned long long & out_size );
+
+// defined in decompress_mt.cc
+class Lzip_index;
+unsigned long long mt_decoder_memory( const unsigned dictionary_size );
+int decompress_mt( const Lzip_index & lzip_index, const int num_workers,
+                   const int infd, const int outfd, const Pretty_print & pp,
+                   const bool testing, const bool sparse );
+int validate_members( const Lzip_index & lzip_index, const int num_workers,
+                      const int infd, const Pretty_print & pp,
+                      std::vector< int > & results );
+int decompress_mt_stream( const int num_workers, const int infd,
+                          const int outfd, const Pretty_print & pp,
+                          const bool testing, const bool sparse,
+                          std::vector< uint8_t > & rest,
+                          unsigned long long & rest_pos,
+                          unsigned long long & data_pos );
+
+// defined in mem_coder.cc
+class LZ_encoder_base;
+
+/* Keeps the encoders released, keyed by their parameters, so that
+   compressing many streams allocates their buffers only once. */
+class Encoder_pool
+  {
+  struct Entry
+    {
+    LZ_encoder_base * encoder;
+    Lzma_options options;		// not used by FLZ_encoder
+    bool zero;
+    bool in_use;
+    };
+  std::vector< Entry > entries;
+
+  Encoder_pool( const Encoder_pool & );		// declared as private
+  void operator=( const Encoder_pool & );	// declared as private
+
+public:
+  Encoder_pool() {}
+  ~Encoder_pool();
+  // return an encoder reading from src and writing to snk
+  LZ_encoder_base * get( const Lzma_options & options, const bool zero,
+                         Data_source & src, Data_sink & snk );
+  void release( LZ_encoder_base * const encoder );
+  void free_idle();		// delete the encoders not in use
+  };
+
+unsigned long long encoder_memory( const Lzma_options & options,
+                                   const bool zero );
+unsigned long long decoder_memory( const unsigned dictionary_size );
+int compress_data( Data_source & src, Data_sink & snk,
+                   const Lzma_options & options,
+                   const unsigned long long member_size, const bool zero,
+                   unsigned long long * const memory = 0,
+                   Encoder_pool * const pool = 0 );
+int decompress_data( Data_source & src, Data_sink & snk,
+                     unsigned * const max_dictionary_size = 0 );
+int compress_buffer( const uint8_t * const inbuf, const long insize,
+                     std::vector< uint8_t > & outbuf,
+                     const Lzma_options & options,
+                     const unsigned long long member_size, const bool zero );
+int decompress_buffer( const uint8_t * const inbuf, const long insize,
+                       std::vector< uint8_t > & outbuf );
+
+// defined in range_dec.cc
+class Block;
+int decompress_range( const Lzip_index & lzip_index, const Block & range,
+                      const int infd, const int outfd,
+                      const Pretty_print & pp, const bool sparse );
+int decompress_range_stream( const Block & range, const int infd,
+                             const int outfd, const Pretty_print & pp,
+                             const bool sparse,
+                             std::vector< uint8_t > & rest,
+                             unsigned long long & rest_pos,
+                             unsigned long long & rest_dpos );
 
 // defined in list.cc
 int list_files( const std::vector< std::string > & filenames,
-                const Cl_options & cl_opts );
+                const Cl_options & cl_opts, const int num_workers );
 
 // defined in main.cc
 struct stat;
@@ -357,13 +772,27 @@ void show_error( const char * const msg, const int errcode = 0,
 void show_file_error( const char * const filename, const char * const msg,
                       const int errcode = 0 );
 void internal_error( const char * const msg );
-class Matchfinder_base;
+void cleanup_and_fail( const int retval );
+void show_member_error( const Pretty_print & pp, const int result,
+                        const unsigned long long pos );
+class LZ_encoder_base;
 void show_cprogress( const unsigned long long cfile_size = 0,
                      const unsigned long long partial_size = 0,
-                     const Matchfinder_base * const m = 0,
+                     const unsigned long long partial_out = 0,
+                     const LZ_encoder_base * const e = 0,
                      const Pretty_print * const p = 0 );
 class Range_decoder;
+class LZ_decoder;
 void show_dprogress( const unsigned long long cfile_size = 0,
                      const unsigned long long partial_size = 0,
+                     const unsigned long long partial_out = 0,
                      const Range_decoder * const d = 0,
+                     const LZ_decoder * const dec = 0,
                      const Pretty_print * const p = 0 );
+/* Write a progress record for the multithreaded coders. Called from the
+   thread writing the output after each member (or block) written, with the
+   bytes coded so far. */
+void show_mt_progress( const unsigned long long cfile_size,
+                       const unsigned long long udata,
+                       const unsigned long long cdata, const long member,
+                       const bool compressing, const Pretty_print & pp );
@@ -23,15 +23,42 @@
 #include <cstring>
 #include <string>
 #include <vector>
+#include <fcntl.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "lzip.h"
 #include "lzip_index.h"
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 
 namespace {
 
+/* Sidecar index file format (all integers little endian):
+     magic "LZix", version (1 byte), 3 zero bytes, file size (8 bytes),
+     modification time, device, and inode number of the file (8 bytes
+     each), number of members (8 bytes), then for each member its member
+     size (8 bytes), data size (8 bytes) and dictionary size (4 bytes), and
+     finally the CRC32 of all the preceding bytes (4 bytes). */
+const uint8_t sidecar_magic[4] = { 0x4C, 0x5A, 0x69, 0x78 };	// "LZix"
+enum { sidecar_version = 2, sidecar_header_size = 48,
+       sidecar_entry_size = 20, sidecar_crc_size = 4 };
+
+unsigned long long get_le( const uint8_t * const buf, const int size )
+  {
+  unsigned long long n = 0;
+  for( int i = size - 1; i >= 0; --i ) { n <<= 8; n += buf[i]; }
+  return n;
+  }
+
+void put_le( uint8_t * const buf, unsigned long long n, const int size )
+  { for( int i = 0; i < size; ++i ) { buf[i] = (uint8_t)n; n >>= 8; } }
+
+
 int seek_read( const int fd, uint8_t * const buf, const int size,
                const long long pos )
   {
@@ -78,6 +105,75 @@ bool Lzip_index::read_header( const int fd, Lzip_header & header,
   }
 
 
+/* Load the member table from the sidecar index, checking that it
+   describes the same file, of the same size and modification time, with
+   the same first header and last trailer. On failure leave the index empty
+   so that the file is scanned. */
+bool Lzip_index::read_sidecar( const int infd, const char * const name )
+  {
+  struct stat st;
+  if( fstat( infd, &st ) != 0 ) return false;
+  const int fd = open( sidecar_name( name ).c_str(), O_RDONLY | O_BINARY );
+  if( fd < 0 ) return false;
+  std::vector< uint8_t > buf( sidecar_header_size );
+  bool ok = readblock( fd, &buf[0], buf.size() ) == (int)buf.size() &&
+            std::memcmp( &buf[0], sidecar_magic, 4 ) == 0 &&
+            buf[4] == sidecar_version &&
+            (long long)get_le( &buf[8], 8 ) == insize &&
+            get_le( &buf[16], 8 ) == (unsigned long long)st.st_mtime &&
+            get_le( &buf[24], 8 ) == (unsigned long long)st.st_dev &&
+            get_le( &buf[32], 8 ) == (unsigned long long)st.st_ino;
+  const unsigned long long members = ok ? get_le( &buf[40], 8 ) : 0;
+  if( ok && members > 0 &&
+      members <= (unsigned long long)insize / min_member_size )
+    {
+    buf.resize( sidecar_header_size + members * sidecar_entry_size +
+                sidecar_crc_size );
+    const int rest = buf.size() - sidecar_header_size;
+    uint8_t dummy;
+    ok = readblock( fd, &buf[sidecar_header_size], rest ) == rest &&
+         readblock( fd, &dummy, 1 ) == 0;		// no data after the CRC
+    }
+  else ok = false;
+  close( fd );
+  if( !ok ) return false;
+  const int crc_pos = buf.size() - sidecar_crc_size;
+  uint32_t crc = 0xFFFFFFFFU;
+  crc32.update_buf( crc, &buf[0], crc_pos );
+  if( ( crc ^ 0xFFFFFFFFU ) != get_le( &buf[crc_pos], 4 ) ) return false;
+
+  unsigned long long mpos = 0, dpos = 0;
+  for( unsigned long i = 0; i < members; ++i )
+    {
+    const uint8_t * const p = &buf[sidecar_header_size+i*sidecar_entry_size];
+    const unsigned long long msize = get_le( p, 8 );
+    const unsigned long long dsize = get_le( p + 8, 8 );
+    const unsigned dictionary_size = get_le( p + 16, 4 );
+    if( msize < min_member_size || msize > insize - mpos ||
+        dsize > INT64_MAX - dpos || !isvalid_ds( dictionary_size ) )
+      { member_vector.clear(); return false; }
+    member_vector.push_back( Member( dpos, dsize, mpos, msize,
+                                     dictionary_size ) );
+    if( dictionary_size_ < dictionary_size )
+      dictionary_size_ = dictionary_size;
+    mpos += msize; dpos += dsize;
+    }
+  Lzip_header header;
+  Lzip_trailer trailer;
+  const Member & last = member_vector.back();
+  if( mpos != (unsigned long long)insize ||		// no trailing data
+      seek_read( infd, header.data, header.size, 0 ) != header.size ||
+      !header.check() ||
+      header.dictionary_size() != member_vector[0].dictionary_size ||
+      seek_read( infd, trailer.data, trailer.size, insize - trailer.size ) !=
+        trailer.size ||
+      trailer.member_size() != (unsigned long long)last.mblock.size() ||
+      trailer.data_size() != (unsigned long long)last.dblock.size() )
+    { member_vector.clear(); dictionary_size_ = 0; return false; }
+  return true;
+  }
+
+
 // If successful, push last member and set pos to member header.
 bool Lzip_index::skip_trailing_data( const int fd, unsigned long long & pos,
                                      const Cl_options & cl_opts )
@@ -142,11 +238,235 @@ bool Lzip_index::skip_trailing_data( const int fd, unsigned long long & pos,
   }
 
 
-Lzip_index::Lzip_index( const int infd, const Cl_options & cl_opts )
-  : insize( lseek( infd, 0, SEEK_END ) ), retval_( 0 ), dictionary_size_( 0 )
+/* Index a non-seekable stream while reading it. The members are found by
+   Stream_scanner, and trailing data are checked as in skip_trailing_data. */
+void Lzip_index::scan_stream( const int infd, const Cl_options & cl_opts )
+  {
+  Fd_source fsrc( infd );
+  Stream_scanner scanner( fsrc, false );
+  unsigned long long dpos = 0;
+  for( bool first = true; ; first = false )
+    {
+    Lzip_header header;
+    Stream_scanner::Result res = scanner.read_header( header );
+    if( res == Stream_scanner::eof && !first ) break;
+    if( res == Stream_scanner::found && !check_header( header ) ) break;
+    if( res == Stream_scanner::found ) res = scanner.find_member_end();
+    if( res == Stream_scanner::read_error )
+      { errno = scanner.read_errno();
+        set_errno_error( "Error reading input file: " ); break; }
+    if( res == Stream_scanner::eof || res == Stream_scanner::truncated )
+      {
+      const unsigned long long end = scanner.stream_end();
+      if( !first ) error_ = "Last member in input file is truncated or corrupt.";
+      else if( end >= min_member_size )
+        { set_num_error( "Bad trailer at pos ", end - Lzip_trailer::size );
+          break; }
+      else error_ = "Input file is truncated.";
+      retval_ = 2; break;
+      }
+    if( res == Stream_scanner::trailing )
+      {
+      int size;
+      const Lzip_header & header2 =
+        *(const Lzip_header *)scanner.next_bytes( size );
+      if( header2.check_prefix( size ) )
+        { error_ = "Last member in input file is truncated."; retval_ = 2;
+          break; }
+      if( !cl_opts.loose_trailing && size >= header2.size &&
+          header2.check_corrupt() )
+        { error_ = corrupt_mm_msg; retval_ = 2; break; }
+      if( !cl_opts.ignore_trailing )
+        { error_ = trailing_msg; retval_ = 2; break; }
+      }
+    const unsigned long long dsize = scanner.dsize();
+    if( dsize > INT64_MAX - dpos )
+      { error_ = "Data in input file is too long (2^63 bytes or more).";
+        retval_ = 2; break; }
+    const unsigned dictionary_size = header.dictionary_size();
+    if( dictionary_size_ < dictionary_size )
+      dictionary_size_ = dictionary_size;
+    member_vector.push_back( Member( dpos, dsize, scanner.mpos(),
+                                     scanner.msize(), dictionary_size ) );
+    dpos += dsize;
+    scanner.take_member();
+    if( res == Stream_scanner::trailing )
+      {
+      if( scanner.skip_to_end() == Stream_scanner::read_error )
+        { errno = scanner.read_errno();
+          set_errno_error( "Error reading input file: " ); }
+      break;
+      }
+    }
+  insize = scanner.stream_end();
+  if( retval_ != 0 ) member_vector.clear();
+  else if( insize > INT64_MAX )
+    { member_vector.clear();
+      error_ = "Input file is too long (2^63 bytes or more)."; retval_ = 2; }
+  }
+
+
+/* Set the data position of each member from the data sizes of the members
+   before it. */
+bool Lzip_index::set_data_positions()
+  {
+  for( unsigned long i = 0; ; ++i )
+    {
+    const long long end = member_vector[i].dblock.end();
+    if( end < 0 || end > INT64_MAX )
+      {
+      member_vector.clear();
+      error_ = "Data in input file is too long (2^63 bytes or more).";
+      retval_ = 2; return false;
+      }
+    if( i + 1 >= member_vector.size() ) return true;
+    member_vector[i+1].dblock.pos( end );
+    }
+  }
+
+
+/* Find the end of the member starting at pos, which must be at or before
+   limit. First check if the member ends at limit (the next header found,
+   or EOF); if not, search the trailer in the data between pos and limit.
+   The most significant byte of the member size in the trailer is 0 for all
+   members shorter than 2^56 bytes, so only the positions before a zero
+   byte, found by memchr, need to be checked. */
+bool Lzip_index::find_trailer( const int infd, const unsigned long long pos,
+                               const unsigned long long limit,
+                               unsigned long long & end )
+  {
+  Lzip_trailer trailer;
+  if( limit - pos >= min_member_size &&
+      preadblock( infd, trailer.data, trailer.size, limit - trailer.size ) ==
+        trailer.size &&
+      trailer.member_size() == limit - pos && trailer.check_consistency() )
+    { end = limit; return true; }
+  enum { block_size = 1 << 20, overlap = Lzip_trailer::size - 1 };
+  std::vector< uint8_t > buf( overlap + block_size );
+  // ipos is the file position of buf[overlap]; q - 1 is the MSB position
+  for( unsigned long long ipos = pos + min_member_size - 1; ipos < limit;
+       ipos += block_size )
+    {
+    const unsigned long long bpos = ipos - overlap;
+    const int size = overlap + std::min( limit - ipos,
+                                         (unsigned long long)block_size );
+    if( preadblock( infd, &buf[0], size, bpos ) != size )
+      { set_errno_error( "Error reading input file: " ); return false; }
+    const uint8_t * p = &buf[overlap];
+    const uint8_t * const bend = &buf[0] + size;
+    while( p < bend &&
+           ( p = (const uint8_t *)std::memchr( p, 0, bend - p ) ) != 0 )
+      {
+      const unsigned long long q = bpos + ( p - &buf[0] ) + 1;
+      const Lzip_trailer & t = *(const Lzip_trailer *)( p + 1 - trailer.size );
+      if( t.member_size() == q - pos && t.check_consistency() )
+        { end = q; return true; }
+      ++p;
+      }
+    }
+  return false;
+  }
+
+
+/* Index the members of a damaged file that look intact; those with a valid
+   header followed by a trailer whose member size matches. The headers are
+   found by searching with memchr the first byte of the magic in large
+   blocks, and checking the rest of the header only there. */
+void Lzip_index::scan_members( const int infd )
+  {
+  member_vector.clear(); error_.clear(); retval_ = 0; dictionary_size_ = 0;
+  recovered_ = true;
+  std::vector< unsigned long long > headers;	// positions of valid headers
+  enum { block_size = 1 << 20, overlap = Lzip_header::size - 1 };
+  std::vector< uint8_t > buf( block_size + overlap );
+  for( unsigned long long ipos = 0; ipos < (unsigned long long)insize;
+       ipos += block_size )
+    {
+    const int size = std::min( insize - ipos, (unsigned long long)buf.size() );
+    if( preadblock( infd, &buf[0], size, ipos ) != size )
+      { set_errno_error( "Error reading input file: " ); return; }
+    const uint8_t * p = &buf[0];
+    const uint8_t * const bend = &buf[0] + std::min( size, (int)block_size );
+    while( p < bend &&
+           ( p = (const uint8_t *)std::memchr( p, lzip_magic[0], bend - p ) ) )
+      {
+      if( &buf[0] + size - p >= Lzip_header::size &&
+          ( (const Lzip_header *)p )->check() )
+        headers.push_back( ipos + ( p - &buf[0] ) );
+      ++p;
+      }
+    }
+  unsigned long long covered = 0;		// end of the last member found
+  for( unsigned long i = 0; i < headers.size(); ++i )
+    {
+    const unsigned long long pos = headers[i];
+    if( pos < covered ) continue;		// header inside a member
+    const unsigned long long limit =
+      ( i + 1 < headers.size() ) ? headers[i+1] : insize;
+    unsigned long long end;
+    if( !find_trailer( infd, pos, limit, end ) )
+      { if( retval_ != 0 ) { member_vector.clear(); return; } continue; }
+    Lzip_header header;
+    Lzip_trailer trailer;
+    if( preadblock( infd, header.data, header.size, pos ) != header.size ||
+        preadblock( infd, trailer.data, trailer.size, end - trailer.size ) !=
+          trailer.size )
+      { set_errno_error( "Error reading input file: " );
+        member_vector.clear(); return; }
+    const unsigned dictionary_size = header.dictionary_size();
+    if( dictionary_size_ < dictionary_size )
+      dictionary_size_ = dictionary_size;
+    member_vector.push_back( Member( 0, trailer.data_size(), pos, end - pos,
+                                     dictionary_size ) );
+    damaged_ += pos - covered;
+    covered = end;
+    }
+  damaged_ += insize - covered;
+  if( member_vector.empty() )
+    { error_ = "No intact members found."; retval_ = 2; return; }
+  set_data_positions();
+  }
+
+
+bool Lzip_index::drop_members( const std::vector< int > & results )
+  {
+  unsigned long j = 0;
+  for( unsigned long i = 0; i < member_vector.size(); ++i )
+    if( results[i] == 0 ) member_vector[j++] = member_vector[i];
+    else damaged_ += member_vector[i].mblock.size();
+  member_vector.erase( member_vector.begin() + j, member_vector.end() );
+  if( member_vector.empty() )
+    { error_ = "No intact members found."; retval_ = 2; return false; }
+  member_vector[0].dblock.pos( 0 );
+  dictionary_size_ = 0;
+  for( unsigned long i = 0; i < member_vector.size(); ++i )
+    if( dictionary_size_ < member_vector[i].dictionary_size )
+      dictionary_size_ = member_vector[i].dictionary_size;
+  return set_data_positions();
+  }
+
+
+Lzip_index::Lzip_index( const int infd, const Cl_options & cl_opts,
+                        const char * const name )
+  : insize( lseek( infd, 0, SEEK_END ) ), damaged_( 0 ), retval_( 0 ),
+    dictionary_size_( 0 ), from_sidecar_( false ), recovered_( false )
   {
   if( insize < 0 )
-    { set_errno_error( "Input file is not seekable: " ); return; }
+    {
+    if( errno == ESPIPE ) scan_stream( infd, cl_opts );
+    else set_errno_error( "Input file is not seekable: " );
+    return;
+    }
+  if( name && insize >= min_member_size && read_sidecar( infd, name ) )
+    { from_sidecar_ = true; return; }
+  index_file( infd, cl_opts );
+  if( retval_ == 2 && cl_opts.recover && insize >= min_member_size &&
+      insize <= INT64_MAX ) scan_members( infd );
+  }
+
+
+void Lzip_index::index_file( const int infd, const Cl_options & cl_opts )
+  {
   Lzip_header header;
   if( insize >= header.size &&
       ( !read_header( infd, header, 0 ) ||
@@ -192,16 +512,152 @@ Lzip_index::Lzip_index( const int infd, const Cl_options & cl_opts )
     return;
     }
   std::reverse( member_vector.begin(), member_vector.end() );
-  for( unsigned long i = 0; ; ++i )
+  set_data_positions();
+  }
+
+
+bool Stream_scanner::fill()
+  {
+  const unsigned long old_size = buf.size();
+  buf.resize( old_size + block_size );
+  const int rd = src.read( &buf[old_size], block_size );
+  buf.resize( old_size + rd );
+  if( rd < block_size )
+    { at_eof = true; if( errno ) { errno_ = errno; return false; } }
+  return true;
+  }
+
+
+// free the buffered data before pos, if they are worth moving the rest
+void Stream_scanner::discard( const unsigned long long pos )
+  {
+  if( pos <= buf_pos ) return;
+  const unsigned long long size = std::min( pos - buf_pos,
+                                            (unsigned long long)buf.size() );
+  if( keep || size >= block_size )
+    { buf.erase( buf.begin(), buf.begin() + size ); buf_pos += size; }
+  }
+
+
+Stream_scanner::Result Stream_scanner::read_header( Lzip_header & header )
+  {
+  while( stream_end() < mpos_ + header.size && !at_eof )
+    if( !fill() ) return read_error;
+  const unsigned long long avail = stream_end() - mpos_;
+  if( avail == 0 ) return eof;
+  const int size = std::min( avail, (unsigned long long)header.size );
+  std::memcpy( header.data, &buf[mpos_ - buf_pos], size );
+  return ( size < header.size ) ? truncated : found;
+  }
+
+
+Stream_scanner::Result
+Stream_scanner::find_member_end( const unsigned long long max_size )
+  {
+  unsigned long long q = mpos_ + min_member_size;	// candidate member end
+  unsigned long long cand_msize = 0, cand_dsize = 0;	// trailing candidate
+  while( true )
     {
-    const long long end = member_vector[i].dblock.end();
-    if( end < 0 || end > INT64_MAX )
+    if( !at_eof && q + Lzip_header::size > stream_end() )
       {
-      member_vector.clear();
-      error_ = "Data in input file is too long (2^63 bytes or more).";
-      retval_ = 2; return;
+      if( keep && max_size > 0 && stream_end() - mpos_ > max_size )
+        return too_long;
+      if( !keep && q > buf_pos + Lzip_trailer::size )
+        discard( q - Lzip_trailer::size );
+      if( !fill() ) return read_error;
+      continue;
       }
-    if( i + 1 >= member_vector.size() ) break;
-    member_vector[i+1].dblock.pos( end );
+    // check the positions that have a full header after them, or all at EOF
+    const unsigned long long limit =
+      at_eof ? stream_end() : stream_end() - Lzip_header::size;
+    const uint8_t * const b = &buf[0];
+    for( ; q <= limit; ++q )
+      {
+      const unsigned long i = q - buf_pos;
+      const unsigned long long msize = q - mpos_;
+      if( b[i-1] != (uint8_t)( msize >> 56 ) ) continue;  // MSB of msize
+      const Lzip_trailer & trailer =
+        *(const Lzip_trailer *)( b + i - Lzip_trailer::size );
+      if( trailer.member_size() != msize || !trailer.check_consistency() )
+        continue;
+      const unsigned long long rest = stream_end() - q;
+      if( rest == 0 || ( rest >= Lzip_header::size &&
+                         ( (const Lzip_header *)( b + i ) )->check() ) )
+        { msize_ = msize; dsize_ = trailer.data_size(); return found; }
+      if( cand_msize == 0 )
+        {
+        cand_msize = msize; cand_dsize = trailer.data_size();
+        next_size = std::min( rest, (unsigned long long)Lzip_header::size );
+        std::memcpy( next_, b + i, next_size );
+        if( keep ) break;	// don't keep the trailing data in memory
+        }
+      }
+    if( at_eof || cand_msize > 0 ) break;
+    }
+  if( cand_msize == 0 ) return truncated;
+  msize_ = cand_msize; dsize_ = cand_dsize;
+  return trailing;
+  }
+
+
+void Stream_scanner::take_member( std::vector< uint8_t > * const member )
+  {
+  if( member )
+    member->assign( buf.begin() + ( mpos_ - buf_pos ),
+                    buf.begin() + ( mpos_ - buf_pos + msize_ ) );
+  mpos_ += msize_; msize_ = 0;
+  discard( mpos_ );
+  }
+
+
+Stream_scanner::Result Stream_scanner::skip_to_end()
+  {
+  while( !at_eof )
+    { buf_pos += buf.size(); buf.clear(); if( !fill() ) return read_error; }
+  return eof;
+  }
+
+
+/* Write the member table to the sidecar index of the file 'name'.
+   Return false and set errno if the sidecar can't be written. */
+bool Lzip_index::write_sidecar( const char * const name ) const
+  {
+  struct stat st;
+  if( stat( name, &st ) != 0 ) return false;
+  const unsigned long members = member_vector.size();
+  std::vector< uint8_t > buf( sidecar_header_size +
+                              members * sidecar_entry_size );
+  std::memcpy( &buf[0], sidecar_magic, 4 );
+  buf[4] = sidecar_version;
+  put_le( &buf[8], insize, 8 );
+  put_le( &buf[16], st.st_mtime, 8 );
+  put_le( &buf[24], st.st_dev, 8 );
+  put_le( &buf[32], st.st_ino, 8 );
+  put_le( &buf[40], members, 8 );
+  for( unsigned long i = 0; i < members; ++i )
+    {
+    uint8_t * const p = &buf[sidecar_header_size+i*sidecar_entry_size];
+    put_le( p, member_vector[i].mblock.size(), 8 );
+    put_le( p + 8, member_vector[i].dblock.size(), 8 );
+    put_le( p + 16, member_vector[i].dictionary_size, 4 );
     }
+  uint32_t crc = 0xFFFFFFFFU;
+  crc32.update_buf( crc, &buf[0], buf.size() );
+  buf.resize( buf.size() + sidecar_crc_size );
+  put_le( &buf[buf.size()-sidecar_crc_size], crc ^ 0xFFFFFFFFU, 4 );
+
+  const std::string sname = sidecar_name( name );
+  const int fd = open( sname.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_BINARY,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH );
+  if( fd < 0 ) return false;
+  const bool ok = writeblock( fd, &buf[0], buf.size() ) == (int)buf.size();
+  const int saved_errno = errno;
+  if( close( fd ) != 0 || !ok )
+    { std::remove( sname.c_str() ); if( !ok ) errno = saved_errno;
+      return false; }
+  return true;
   }
+
+
+std::string sidecar_name( const char * const name )
+  { std::string s( name ); s += ".lzidx"; return s; }
@@ -36,6 +36,32 @@ public:
   };
 
 
+// writes to snk only the bytes of the decompressed stream inside range
+class Range_sink : public Data_sink
+  {
+  Data_sink & snk;
+  const Block & range;
+  long long pos;		// position of next byte in decompressed data
+
+public:
+  Range_sink( Data_sink & s, const Block & r, const long long p )
+    : snk( s ), range( r ), pos( p ) {}
+
+  int write( const uint8_t * const buf, const int size )
+    {
+    const long long begin = std::max( pos, range.pos() );
+    const long long end = std::min( pos + size, range.end() );
+    if( begin < end )
+      {
+      const int sz = end - begin;
+      if( snk.write( buf + ( begin - pos ), sz ) != sz ) return 0;
+      }
+    pos += size;
+    return size;
+    }
+  };
+
+
 class Lzip_index
   {
   struct Member
@@ -52,9 +78,12 @@ class Lzip_index
 
   std::vector< Member > member_vector;
   std::string error_;
-  const long long insize;
+  long long insize;
+  unsigned long long damaged_;	// bytes not in any member, if recovered
   int retval_;
   unsigned dictionary_size_;	// largest dictionary size in the file
+  bool from_sidecar_;
+  bool recovered_;		// indexed by scan_members
 
   bool check_header( const Lzip_header & header );
   void set_errno_error( const char * const msg );
@@ -62,9 +91,23 @@ class Lzip_index
   bool read_header( const int fd, Lzip_header & header, const long long pos );
   bool skip_trailing_data( const int fd, unsigned long long & pos,
                            const Cl_options & cl_opts );
+  bool read_sidecar( const int infd, const char * const name );
+  void scan_stream( const int infd, const Cl_options & cl_opts );
+  void index_file( const int infd, const Cl_options & cl_opts );
+  bool find_trailer( const int infd, const unsigned long long pos,
+                     const unsigned long long limit, unsigned long long & end );
+  void scan_members( const int infd );
+  bool set_data_positions();
 
 public:
-  Lzip_index( const int infd, const Cl_options & cl_opts );
+  /* If name is not null, try first to load the sidecar index of the file
+     'name', and scan the file only if the sidecar is missing or stale.
+     A non-seekable infd is scanned forward, consuming its data.
+     If cl_opts.recover and a seekable file can't be indexed because it is
+     damaged, index instead the members that look intact, skipping the
+     damaged data. */
+  Lzip_index( const int infd, const Cl_options & cl_opts,
+              const char * const name = 0 );
 
   long members() const { return member_vector.size(); }
   const std::string & error() const { return error_; }
@@ -97,4 +140,88 @@ public:
     { return member_vector[i].mblock; }
   unsigned dictionary_size( const long i ) const
     { return member_vector[i].dictionary_size; }
+
+  // bytes skipped because they are not part of any intact member
+  unsigned long long damaged() const { return damaged_; }
+  // the file was damaged and only the members that look intact are indexed
+  bool recovered() const { return recovered_; }
+
+  /* Remove the members whose result is not 0, counting them as damaged.
+     Return false if no members remain. */
+  bool drop_members( const std::vector< int > & results );
+
+  bool from_sidecar() const { return from_sidecar_; }
+  bool write_sidecar( const char * const name ) const;
+  };
+
+
+// name of the sidecar index of the lzip file 'name'
+std::string sidecar_name( const char * const name );
+
+
+/* Forward scanner of a non-seekable stream. It finds the members as the
+   stream is read, without decoding them: a member ends where a trailer
+   whose member size matches the distance to the member header is followed
+   either by the header of the next member or by the end of the stream.
+   If 'keep' is true, the current member stays in memory until it is taken
+   with take_member; else only a small window of the stream is kept. */
+class Stream_scanner
+  {
+public:
+  enum Result { found, eof, trailing, truncated, too_long, read_error };
+
+private:
+  enum { block_size = 65536 };
+  Data_source & src;
+  std::vector< uint8_t > buf;	// buffered data of the stream (and member)
+  unsigned long long buf_pos;	// position in the stream of buf[0]
+  unsigned long long mpos_;	// position of the current member
+  unsigned long long msize_;	// size of the member found
+  unsigned long long dsize_;	// data size from its trailer
+  int errno_;			// errno of the failed read, or 0
+  uint8_t next_[Lzip_header::size];	// first bytes of the trailing data
+  int next_size;
+  bool at_eof;
+  const bool keep;
+
+  bool fill();
+  void discard( const unsigned long long pos );
+
+public:
+  Stream_scanner( Data_source & s, const bool k )
+    : src( s ), buf_pos( 0 ), mpos_( 0 ), msize_( 0 ), dsize_( 0 ),
+      errno_( 0 ), next_size( 0 ), at_eof( false ), keep( k ) {}
+
+  /* Read the header of the next member into header. Return eof if no more
+     data remain, 'truncated' if the stream ends before a full header, or
+     read_error. The header may be invalid; the caller must check it. */
+  Result read_header( Lzip_header & header );
+
+  /* Find the end of the member whose header was the last one read. Return
+     'found', 'trailing' if the member is followed by trailing data (which
+     start at mpos() + msize()), 'truncated' if no end is found, too_long
+     if the member is kept and it is larger than max_size, or read_error. */
+  Result find_member_end( const unsigned long long max_size = 0 );
+
+  unsigned long long mpos() const { return mpos_; }
+  unsigned long long msize() const { return msize_; }
+  unsigned long long dsize() const { return dsize_; }
+  unsigned long long stream_end() const { return buf_pos + buf.size(); }
+  int read_errno() const { return errno_; }
+
+  // the first bytes (up to a header) following a member with trailing data
+  const uint8_t * next_bytes( int & size ) const
+    { size = next_size; return next_; }
+
+  /* Move the member found to 'member' (if keep) and advance to the next
+     member. */
+  void take_member( std::vector< uint8_t > * const member = 0 );
+
+  Result skip_to_end();		// read and discard the rest of the stream
+
+  /* Move the bytes of the stream read from the start of the current member
+     to 'rest', so that the caller can decode the rest of the stream. */
+  void take_rest( std::vector< uint8_t > & rest )
+    { rest.assign( buf.begin() + ( mpos_ - buf_pos ), buf.end() );
+      buf.clear(); buf_pos = mpos_ + rest.size(); }
   };
@@ -31,14 +31,20 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <new>
 #include <string>
 #include <vector>
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdint.h>		// SIZE_MAX
 #include <unistd.h>
 #include <utime.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#if !defined __MSVCRT__ && !defined __DJGPP__
+#include <sys/wait.h>
+#endif
 #if defined __MSVCRT__ || defined __OS2__ || defined __DJGPP__
 #include <io.h>
 #if defined __MSVCRT__
@@ -68,6 +74,7 @@
 #include "encoder_base.h"
 #include "encoder.h"
 #include "fast_encoder.h"
+#include "lzip_index.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -95,19 +102,21 @@ const struct { const char * from; const char * to; } known_extensions[] = {
   { ".tlz", ".tar" },
   { 0,      0      } };
 
-struct Lzma_options
-  {
-  int dictionary_size;		// 4 KiB .. 512 MiB
-  int match_len_limit;		// 5 .. 273
-  };
-
-enum Mode { m_compress, m_decompress, m_list, m_test };
+enum Mode { m_compress, m_decompress, m_list, m_test, m_bench };
 
 /* Variables used in signal handler context.
    They are not declared volatile because the handler never returns. */
 std::string output_filename;
 int outfd = -1;
 bool delete_output_on_interrupt = false;
+long long append_size = -1;	// size of the file being appended to, or -1
+
+Encoder_pool encoder_pool;	// the encoder is reused for all the files
+Dictionary_buffer dictionary_buffer;	// so is the dictionary of the decoder
+bool async_io = false;		// serial coders do I/O in separate threads
+bool append_output = false;	// append members to existing output files
+unsigned long long memory_limit = 0;	// bytes for the coders, or 0
+int progress_fd = -1;		// where to write progress records, or -1
 
 
 void show_help()
@@ -136,16 +145,29 @@ void show_help()
                "  -k, --keep                     keep (don't delete) input files\n"
                "  -l, --list                     print (un)compressed file sizes\n"
                "  -m, --match-length=<bytes>     set match length limit in bytes [36]\n"
+               "  -n, --threads=<n>              set number of (de)compression threads [1]\n"
                "  -o, --output=<file>            write to <file>, keep input files\n"
                "  -q, --quiet                    suppress all messages\n"
+               "  -r, --recursive                operate recursively on directories\n"
                "  -s, --dictionary-size=<bytes>  set dictionary size limit in bytes [8 MiB]\n"
                "  -S, --volume-size=<bytes>      set volume size limit in bytes\n"
                "  -t, --test                     test compressed file integrity\n"
                "  -v, --verbose                  be verbose (a 2nd -v gives more)\n"
                "  -0 .. -9                       set compression level [default 6]\n"
-               "      --fast                     alias for -0\n"
+               "      --fast[=<n>]               alias for -0, or fast level 1 to 3\n"
                "      --best                     alias for -9\n"
+               "      --append                   append new members to existing output files\n"
+               "      --async-io                 overlap reading and writing with (de)compression\n"
+               "      --auto=<target>            choose level for speed:<MB/s> or ratio:<x>\n"
+               "      --bench[=tsv]              measure speed of every level on the files\n"
                "      --loose-trailing           allow trailing data seeming corrupt header\n"
+               "      --make-index               write sidecar index when compressing or listing\n"
+               "      --memory-limit=<bytes>     reduce threads and dictionary size to fit limit\n"
+               "      --progress-fd=<n>          write progress records to file descriptor <n>\n"
+               "      --range=<begin>-<end>      decompress only a range of bytes (see manual)\n"
+               "      --recover                  skip damaged data, keep intact members\n"
+               "      --sparse                   leave holes in output for blocks of zeros\n"
+               "      --stats                    show statistics of the coders (if compiled in)\n"
                "\nIf no file names are given, or if a file is '-', lzip compresses or\n"
                "decompresses from standard input to standard output.\n"
                "Numbers may be followed by a multiplier: k = kB = 10^3 = 1000,\n"
@@ -326,6 +348,48 @@ unsigned long long getnum( const char * const arg,
   }
 
 
+/* Parse a range of decompressed bytes given as 'begin-end' (end not
+   included), 'begin,size', or 'begin-' (up to the end of the data). */
+void parse_range( const char * const arg, const char * const option_name,
+                  Block & range )
+  {
+  const unsigned long long max_pos = 0x7FFFFFFFFFFFFFFFULL;
+  const std::string s( arg );
+  const unsigned long i = s.find_first_of( ",-", 1 );
+  if( i == std::string::npos || ( s[i] == ',' && i + 1 >= s.size() ) )
+    { show_option_error( arg, "Missing end or size of range in",
+                         option_name ); std::exit( 1 ); }
+  const unsigned long long begin =
+    getnum( s.substr( 0, i ).c_str(), option_name, 0, max_pos - 1 );
+  const std::string tail = s.substr( i + 1 );
+  unsigned long long size;
+  if( tail.empty() ) size = max_pos - begin;
+  else if( s[i] == ',' )
+    size = getnum( tail.c_str(), option_name, 1, max_pos - begin );
+  else size = getnum( tail.c_str(), option_name, begin + 1, max_pos ) - begin;
+  range.pos( begin ); range.size( size );
+  }
+
+
+/* Parse the goal of '--auto' given as 'speed:<MB/s>' (optionally followed
+   by 'MB/s') or 'ratio:<x>' (optionally followed by ':1'). */
+void parse_auto( const char * const arg, const char * const option_name,
+                 Auto_target & target )
+  {
+  const std::string s( arg );
+  const bool speed = s.compare( 0, 6, "speed:" ) == 0;
+  const bool ratio = s.compare( 0, 6, "ratio:" ) == 0;
+  char * tail = 0;
+  const double value = ( speed || ratio ) ? std::strtod( arg + 6, &tail ) : 0;
+  if( value <= 0 || value > 1e9 || !tail || ( *tail &&
+      std::strcmp( tail, speed ? "MB/s" : ":1" ) != 0 ) )
+    { show_option_error( arg, "Invalid target in", option_name );
+      std::exit( 1 ); }
+  target.speed = speed ? value : 0;
+  target.ratio = ratio ? value : 0;
+  }
+
+
 int get_dict_size( const char * const arg, const char * const option_name )
   {
   char * tail;
@@ -464,6 +528,32 @@ bool make_dirs( const std::string & name )
   }
 
 
+/* Check that the existing file just opened for appending is a regular lzip
+   file without trailing data, and move to its end. An empty file is also
+   accepted. On error, close the file without deleting it. */
+bool check_append()
+  {
+  const char * const name = output_filename.c_str();
+  struct stat st;
+  bool ok = fstat( outfd, &st ) == 0 && S_ISREG( st.st_mode );
+  if( !ok ) show_file_error( name, "Can only append to a regular file." );
+  if( ok && st.st_size > 0 )
+    {
+    Cl_options cl_opts;
+    cl_opts.ignore_trailing = false;	// new members would follow them
+    const Lzip_index lzip_index( outfd, cl_opts );
+    if( lzip_index.retval() != 0 )
+      { show_file_error( name, lzip_index.error().c_str() ); ok = false; }
+    }
+  if( ok && lseek( outfd, 0, SEEK_END ) != st.st_size )
+    { show_file_error( name, "Seek error", errno ); ok = false; }
+  if( !ok ) { close( outfd ); outfd = -1; return false; }
+  append_size = st.st_size;
+  delete_output_on_interrupt = true;
+  return true;
+  }
+
+
 bool open_outstream( const bool force, const bool protect )
   {
   const mode_t usr_rw = S_IRUSR | S_IWUSR;
@@ -479,6 +569,15 @@ bool open_outstream( const bool force, const bool protect )
     if( !protect && !make_dirs( output_filename ) )
       { show_file_error( output_filename.c_str(),
           "Error creating intermediate directory", errno ); return false; }
+    if( append_output )
+      {
+      outfd = open( output_filename.c_str(), O_RDWR | O_BINARY );
+      if( outfd >= 0 ) return check_append();
+      if( errno != ENOENT )
+        { show_file_error( output_filename.c_str(),
+            "Can't open output file", errno ); return false; }
+      flags = O_CREAT | O_EXCL | O_WRONLY | O_BINARY;	// create it
+      }
     outfd = open( output_filename.c_str(), flags, outfd_mode );
     if( outfd >= 0 ) { delete_output_on_interrupt = true; return true; }
     if( errno == EEXIST )
@@ -497,6 +596,8 @@ void set_signals( void (*action)(int) )
   std::signal( SIGTERM, action );
   }
 
+} // end namespace
+
 
 void cleanup_and_fail( const int retval )
   {
@@ -504,15 +605,82 @@ void cleanup_and_fail( const int retval )
   if( delete_output_on_interrupt )
     {
     delete_output_on_interrupt = false;
-    show_file_error( output_filename.c_str(),
-                     "Deleting output file, if it exists." );
-    if( outfd >= 0 ) { close( outfd ); outfd = -1; }
-    if( std::remove( output_filename.c_str() ) != 0 && errno != ENOENT )
-      show_error( "warning: deletion of output file failed", errno );
+    if( append_size >= 0 && outfd >= 0 )	// restore the original file
+      {
+      show_file_error( output_filename.c_str(),
+                       "Removing the data appended to output file." );
+      if( ftruncate( outfd, append_size ) != 0 )
+        show_error( "warning: truncation of output file failed", errno );
+      close( outfd ); outfd = -1;
+      }
+    else
+      {
+      show_file_error( output_filename.c_str(),
+                       "Deleting output file, if it exists." );
+      if( outfd >= 0 ) { close( outfd ); outfd = -1; }
+      if( std::remove( output_filename.c_str() ) != 0 && errno != ENOENT )
+        show_error( "warning: deletion of output file failed", errno );
+      }
     }
   std::exit( retval );
   }
 
+namespace {
+
+/* State of the progress records of the file being coded. Records are
+   written to progress_fd at most once per second, and once at the end of
+   each file coded. */
+struct Progress
+  {
+  double start;				// wall time at start of file
+  double last;				// wall time of last record
+  unsigned long long last_udata;	// uncompressed bytes at last record
+  int member;				// 1-based index of the current member
+  } progress;
+
+double wall_time()
+  {
+  struct timeval tv;
+  gettimeofday( &tv, 0 );
+  return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+void start_progress()
+  { progress.start = progress.last = wall_time(); progress.last_udata = 0;
+    progress.member = 0; }
+
+/* Write a record with the bytes read and written so far. udata and cdata
+   are the uncompressed and compressed bytes. csize is the size of the
+   input file divided by 100, or 0 if unknown. The rate is the MB/s of
+   uncompressed data since the previous record. */
+void write_progress( const char * const event, const bool compressing,
+                     const Pretty_print & pp, const unsigned long long csize,
+                     const unsigned long long udata,
+                     const unsigned long long cdata )
+  {
+  const double now = wall_time();
+  const bool last = std::strcmp( event, "end" ) == 0;
+  if( !last && now - progress.last < 1.0 ) return;
+  const double time = now - progress.last;
+  const double rate = ( time > 0 && udata >= progress.last_udata ) ?
+    ( udata - progress.last_udata ) / time / 1e6 : 0;
+  char buf[256];
+  int len = snprintf( buf, sizeof buf, "%s mode=%c member=%d elapsed=%.3f "
+    "in=%llu out=%llu ratio=%.3f rate=%.2f", event, compressing ? 'c' : 'd',
+    progress.member, now - progress.start, compressing ? udata : cdata,
+    compressing ? cdata : udata, cdata ? (double)udata / cdata : 0.0, rate );
+  if( csize > 0 && len < (int)sizeof buf )
+    len += snprintf( buf + len, sizeof buf - len, " percent=%llu",
+                     last ? 100 : ( compressing ? udata : cdata ) / csize );
+  std::string record( buf, std::min( len, (int)sizeof buf - 1 ) );
+  record += " file="; record += pp.name(); record += '\n';
+  if( writeblock( progress_fd, (const uint8_t *)record.data(),
+                  record.size() ) != (int)record.size() )
+    { show_error( "Error writing progress records", errno );
+      progress_fd = -1; }		// don't stop coding
+  progress.last = now; progress.last_udata = udata;
+  }
+
 
 extern "C" void signal_handler( int )
   {
@@ -521,6 +689,14 @@ extern "C" void signal_handler( int )
   }
 
 
+// a mapped input file has been truncated by another process
+extern "C" void sigbus_handler( int )
+  {
+  show_error( "Input file was truncated while being read." );
+  cleanup_and_fail( 1 );
+  }
+
+
 bool check_tty_in( const char * const input_filename, const int infd,
                    const Mode program_mode, int & retval )
   {
@@ -565,6 +741,7 @@ void close_and_set_permissions( const struct stat * const in_statsp )
                        errno ); cleanup_and_fail( 1 ); }
   outfd = -1;
   delete_output_on_interrupt = false;
+  append_size = -1;
   if( in_statsp )
     {
     struct utimbuf t;
@@ -578,6 +755,25 @@ void close_and_set_permissions( const struct stat * const in_statsp )
   }
 
 
+// Index the output file just closed and write its sidecar index.
+int make_sidecar( const Cl_options & cl_opts )
+  {
+  const char * const name = output_filename.c_str();
+  const int fd = open( name, O_RDONLY | O_BINARY );
+  if( fd < 0 )
+    { show_file_error( name, "Can't reopen output file", errno ); return 1; }
+  const Lzip_index lzip_index( fd, cl_opts );
+  close( fd );
+  if( lzip_index.retval() != 0 )
+    { show_file_error( name, lzip_index.error().c_str() );
+      return lzip_index.retval(); }
+  if( !lzip_index.write_sidecar( name ) )
+    { show_file_error( sidecar_name( name ).c_str(),
+                       "Can't write index file", errno ); return 1; }
+  return 0;
+  }
+
+
 bool next_filename()
   {
   const unsigned name_len = output_filename.size();
@@ -592,35 +788,182 @@ bool next_filename()
   }
 
 
+/* Close the current volume and open the next one. With '--append', skip
+   the volumes already full, and set partial_volume_size to the size of
+   the volume opened. */
+bool next_volume( const unsigned long long volume_size,
+                  const struct stat * const in_statsp, const Pretty_print & pp,
+                  unsigned long long & partial_volume_size )
+  {
+  do {
+    close_and_set_permissions( ( append_size < 0 ) ? in_statsp : 0 );
+    if( !next_filename() ) { pp( "Too many volume files." ); return false; }
+    if( !open_outstream( true, in_statsp ) ) return false;
+    partial_volume_size = std::max( append_size, 0LL );
+    }
+  while( partial_volume_size >= volume_size - min_dictionary_size );
+  return true;
+  }
+
+
+void show_cresult( const unsigned long long in_size,
+                   const unsigned long long out_size, const int retval )
+  {
+  if( retval == 0 && verbosity >= 1 )
+    {
+    if( in_size == 0 || out_size == 0 )
+      std::fputs( " no data compressed.\n", stderr );
+    else
+      std::fprintf( stderr, "%6.3f:1, %5.2f%% ratio, %5.2f%% saved, "
+                            "%llu in, %llu out.\n",
+                    (double)in_size / out_size,
+                    ( 100.0 * out_size ) / in_size,
+                    100.0 - ( ( 100.0 * out_size ) / in_size ),
+                    in_size, out_size );
+    }
+  }
+
+
+/* Read a sample from the start of the input and set options and zero to
+   the level chosen for target. A seekable input is sampled with pread;
+   else the sample is returned in prefix, to be compressed first. */
+bool choose_level( const int infd, const Lzma_options option_mapping[],
+                   const Auto_target & target, const int num_workers,
+                   const unsigned long long file_size,
+                   const unsigned long long member_size,
+                   Lzma_options & options, bool & zero,
+                   std::vector< uint8_t > & prefix, const Pretty_print & pp )
+  {
+  enum { sample_size = 1 << 20 };
+  std::vector< uint8_t > sample( sample_size );
+  const long long pos = lseek( infd, 0, SEEK_CUR );
+  const int size = ( pos >= 0 ) ?
+    preadblock( infd, &sample[0], sample_size, pos ) :
+    readblock( infd, &sample[0], sample_size );
+  if( size < sample_size && errno )
+    { show_file_error( pp.name(), "Read error", errno ); return false; }
+  sample.resize( size );
+  const int level = auto_level( size ? &sample[0] : 0, size, option_mapping,
+                                target, num_workers, file_size, member_size );
+  if( level >= 0 )
+    {
+    options = option_mapping[level]; zero = level == 0;
+    if( verbosity >= 2 ) { pp(); std::fprintf( stderr, "level -%d, ", level ); }
+    }
+  if( pos < 0 ) prefix.swap( sample );
+  return true;
+  }
+
+
+/* Reduce the number of threads, and then the dictionary size, until the
+   memory used by the encoders fits in memory_limit. Return false if it
+   does not fit even with one thread and the minimum dictionary size. */
+bool fit_memory_limit( Lzma_options & options, const bool zero,
+                       int & workers, const Pretty_print & pp )
+  {
+  const int old_workers = workers;
+  const int old_size = options.dictionary_size;
+  while( true )
+    {
+    const int data_size = zero ? 1 << 20 : 2 * options.dictionary_size;
+    const unsigned long long memory = ( workers > 1 ) ?
+      compress_mt_memory( data_size, options, workers, zero ) :
+      encoder_memory( options, zero );
+    if( memory <= memory_limit ) break;
+    if( workers > 1 ) --workers;
+    else if( !zero && options.dictionary_size > min_dictionary_size )
+      options.dictionary_size =		// largest power of 2 smaller
+        1 << ( real_bits( options.dictionary_size - 1 ) - 1 );
+    else { pp( "Memory limit is too small to compress." ); return false; }
+    }
+  if( verbosity >= 1 &&
+      ( workers != old_workers || options.dictionary_size != old_size ) )
+    {
+    pp();
+    std::fputs( "memory limit: ", stderr );
+    if( !zero )
+      std::fprintf( stderr, "dict %s, ", format_ds( options.dictionary_size ) );
+    std::fprintf( stderr, "%d %s, ", workers,
+                  ( workers == 1 ) ? "thread" : "threads" );
+    }
+  return true;
+  }
+
+
 int compress( const unsigned long long cfile_size,
               const unsigned long long member_size,
               const unsigned long long volume_size, const int infd,
               const Lzma_options & encoder_options, const Pretty_print & pp,
-              const struct stat * const in_statsp, const bool zero )
+              const struct stat * const in_statsp, const int num_workers,
+              const bool zero, const std::vector< uint8_t > & prefix )
   {
-  LZ_encoder_base * encoder = 0;		// polymorphic encoder
   if( verbosity >= 1 ) pp();
 
-  if( zero )
-    encoder = new FLZ_encoder( infd, outfd );
-  else
+  int dictionary_size = 0;			// not used by FLZ_encoder
+  if( !zero )
     {
     Lzip_header header;
     if( header.dictionary_size( encoder_options.dictionary_size ) &&
         encoder_options.match_len_limit >= min_match_len_limit &&
         encoder_options.match_len_limit <= max_match_len )
-      encoder = new LZ_encoder( header.dictionary_size(),
-                                encoder_options.match_len_limit, infd, outfd );
+      dictionary_size = header.dictionary_size();
     else internal_error( "invalid argument to encoder." );
     }
+  Lzma_options options = encoder_options;
+  options.dictionary_size = dictionary_size;
+
+  unsigned long long in_size = 0, out_size = 0;
+  unsigned long long partial_volume_size = std::max( append_size, 0LL );
+  if( volume_size > 0 && delete_output_on_interrupt &&
+      partial_volume_size >= volume_size - min_dictionary_size &&
+      !next_volume( volume_size, in_statsp, pp, partial_volume_size ) )
+    return 1;
+  /* Use several threads only if the input is not known to fit in one block.
+     Splitting in volumes is done serially. */
+  int data_size = zero ? 1 << 20 : 2 * dictionary_size;
+  const unsigned long long blocks = ( cfile_size > 0 ) ?
+    ( cfile_size * 100 + data_size - 1 ) / data_size : num_workers;
+  int workers = ( volume_size > 0 ) ? 1 :
+    std::min( (unsigned long long)num_workers, blocks );
+  if( memory_limit > 0 )
+    {
+    encoder_pool.free_idle();		// not counted by fit_memory_limit
+    if( !fit_memory_limit( options, zero, workers, pp ) ) return 1;
+    if( !zero ) data_size = 2 * options.dictionary_size;
+    }
+  if( workers > 1 )
+    {
+    Fd_source fsrc( infd );
+    Prefix_source psrc( prefix, fsrc );	// sample read by '--auto'
+    if( progress_fd >= 0 ) start_progress();
+    const int retval = compress_mt( cfile_size, member_size, data_size,
+                         options, workers, psrc, outfd, pp, zero, in_size,
+                         out_size );
+    if( progress_fd >= 0 && retval == 0 )
+      write_progress( "end", true, pp, cfile_size, in_size, out_size );
+    show_cresult( in_size, out_size, retval );
+    return retval;
+    }
+
+  // the matchfinder uses mapped data, or reads them in a separate thread
+  Mmap_source msrc( infd, !async_io && prefix.empty() );
+  Async_source asrc( infd );
+  Data_source & dsrc = async_io ? (Data_source &)asrc : (Data_source &)msrc;
+  Prefix_source psrc( prefix, dsrc );		// sample read by '--auto'
+  Data_source & isrc = prefix.empty() ? dsrc : (Data_source &)psrc;
+  Fd_sink fsnk( outfd );
+  Async_sink asnk( outfd );		// volumes are written directly
+  const bool async_out = async_io && volume_size == 0;
+  Data_sink & osnk = async_out ? (Data_sink &)asnk : (Data_sink &)fsnk;
+  LZ_encoder_base * const encoder =		// polymorphic encoder
+    encoder_pool.get( options, zero, isrc, osnk );
 
-  unsigned long long in_size = 0, out_size = 0, partial_volume_size = 0;
   int retval = 0;
   while( true )		// encode one member per iteration
     {
     const unsigned long long size = (volume_size > 0) ?
       std::min( member_size, volume_size - partial_volume_size ) : member_size;
-    show_cprogress( cfile_size, in_size, encoder, &pp );	// init
+    show_cprogress( cfile_size, in_size, out_size, encoder, &pp );	// init
     if( !encoder->encode_member( size ) )
       { pp( "Encoder error." ); retval = 1; break; }
     in_size += encoder->data_position();
@@ -632,31 +975,18 @@ int compress( const unsigned long long cfile_size,
       if( partial_volume_size >= volume_size - min_dictionary_size )
         {
         partial_volume_size = 0;
-        if( delete_output_on_interrupt )
-          {
-          close_and_set_permissions( in_statsp );
-          if( !next_filename() )
-            { pp( "Too many volume files." ); retval = 1; break; }
-          if( !open_outstream( true, in_statsp ) ) { retval = 1; break; }
-          }
+        if( delete_output_on_interrupt &&
+            !next_volume( volume_size, in_statsp, pp, partial_volume_size ) )
+          { retval = 1; break; }
         }
       }
     encoder->reset();
     }
-
-  if( retval == 0 && verbosity >= 1 )
-    {
-    if( in_size == 0 || out_size == 0 )
-      std::fputs( " no data compressed.\n", stderr );
-    else
-      std::fprintf( stderr, "%6.3f:1, %5.2f%% ratio, %5.2f%% saved, "
-                            "%llu in, %llu out.\n",
-                    (double)in_size / out_size,
-                    ( 100.0 * out_size ) / in_size,
-                    100.0 - ( ( 100.0 * out_size ) / in_size ),
-                    in_size, out_size );
-    }
-  delete encoder;
+  encoder_pool.release( encoder );
+  if( async_out && !asnk.flush() ) throw Error( wr_err_msg );
+  if( progress_fd >= 0 && retval == 0 )
+    write_progress( "end", true, pp, cfile_size, in_size, out_size );
+  show_cresult( in_size, out_size, retval );
   return retval;
   }
 
@@ -695,16 +1025,173 @@ bool show_trailing_data( const uint8_t * const data, const int size,
   }
 
 
+/* Enlarge the buffer of an output pipe (only on Linux) so that the large
+   blocks written by the decoder pass to the reader in fewer steps. */
+void enlarge_pipe( const int fd )
+  {
+#ifdef F_SETPIPE_SZ
+  struct stat st;
+  if( fstat( fd, &st ) == 0 && S_ISFIFO( st.st_mode ) )
+    fcntl( fd, F_SETPIPE_SZ, 1 << 20 );		// ignore errors
+#endif
+  }
+
+
+const char * const mem_limit_msg = "Dictionary size exceeds the memory limit.";
+
+/* Return the number of decoders of dictionary_size bytes, at most
+   num_workers, that fit in memory_limit, or 0 if not even one fits. */
+int decoder_workers( const unsigned dictionary_size, const int num_workers )
+  {
+  if( memory_limit == 0 ) return num_workers;
+  if( decoder_memory( dictionary_size ) > memory_limit ) return 0;
+  int workers = num_workers;
+  while( workers > 1 &&
+         workers * mt_decoder_memory( dictionary_size ) > memory_limit )
+    --workers;
+  return workers;
+  }
+
+
 int decompress( const unsigned long long cfile_size, const int infd,
                 const Cl_options & cl_opts, const Pretty_print & pp,
+                const int num_workers, const Block * const range,
                 const bool from_stdin, const bool testing )
   {
-  unsigned long long partial_file_pos = 0;
-  Range_decoder rdec( infd );
+  const bool seekable = lseek( infd, 0, SEEK_CUR ) >= 0;
+  const bool sparse = cl_opts.sparse && !testing && outfd >= 0 &&
+                      sparse_ok( outfd );
+  if( range && seekable )	// decode only the members needed, in place
+    {
+    const Lzip_index lzip_index( infd, cl_opts, from_stdin ? 0 : pp.name() );
+    if( lzip_index.retval() != 0 )
+      { show_file_error( pp.name(), lzip_index.error().c_str() );
+        return lzip_index.retval(); }
+    if( decoder_workers( lzip_index.dictionary_size(), 1 ) == 0 )
+      { pp( mem_limit_msg ); return 1; }
+    if( outfd >= 0 ) enlarge_pipe( outfd );
+    return decompress_range( lzip_index, *range, infd, outfd, pp, sparse );
+    }
+
+  /* Recover the intact members of a regular file that can't be indexed
+     normally. The members that look intact are tested in parallel, and
+     only those that pass are decoded. Testing fails if any data were
+     skipped; decompressing only warns about them. A file indexed normally
+     is decoded as usual. */
+  if( cl_opts.recover && cfile_size > 0 && !from_stdin )
+    {
+    Lzip_index lzip_index( infd, cl_opts );
+    if( lzip_index.retval() != 0 )
+      { show_file_error( pp.name(), lzip_index.error().c_str() );
+        return lzip_index.retval(); }
+    if( lzip_index.recovered() )
+      {
+      const int workers =
+        decoder_workers( lzip_index.dictionary_size(), num_workers );
+      if( workers == 0 ) { pp( mem_limit_msg ); return 1; }
+      std::vector< int > results;
+      if( progress_fd >= 0 ) start_progress();
+      if( validate_members( lzip_index, workers, infd, pp, results ) != 0 )
+        return 1;
+      if( !lzip_index.drop_members( results ) )
+        { show_file_error( pp.name(), lzip_index.error().c_str() ); return 2; }
+      const unsigned long long damaged = lzip_index.damaged();
+      int retval = 0;
+      if( testing ) { if( verbosity >= 1 && damaged == 0 ) pp( "ok" ); }
+      else
+        {
+        if( verbosity >= 1 ) pp();
+        if( outfd >= 0 ) enlarge_pipe( outfd );
+        retval = decompress_mt( lzip_index, workers, infd, outfd, pp,
+                                false, sparse );
+        }
+      if( progress_fd >= 0 && retval == 0 )
+        { progress.member = lzip_index.members();	// also if testing
+          write_progress( "end", false, pp, cfile_size,
+                          lzip_index.udata_size(), lzip_index.cdata_size() ); }
+      if( retval == 0 && damaged > 0 )
+        {
+        if( verbosity >= 0 )
+          std::fprintf( stderr, "%s: %s: %s%ld members recovered, "
+                        "%llu bytes of damaged data skipped.\n", program_name,
+                        pp.name(), testing ? "" : "warning: ",
+                        lzip_index.members(), damaged );
+        if( testing ) retval = 2;
+        }
+      return retval;
+      }
+    if( lseek( infd, 0, SEEK_SET ) != 0 )
+      { show_file_error( pp.name(), "Seek error", errno ); return 1; }
+    }
+
+  /* Decode multimember regular files in parallel. Anything unusual
+     (errors, empty members, -vv) is left to the serial decoder. */
+  if( num_workers > 1 && cfile_size > 0 && !from_stdin && verbosity < 2 )
+    {
+    const Lzip_index lzip_index( infd, cl_opts, pp.name() );
+    const int workers = ( lzip_index.retval() == 0 ) ?
+      decoder_workers( lzip_index.dictionary_size(), num_workers ) : 0;
+    if( workers > 1 && lzip_index.members() > 1 &&
+        !lzip_index.multi_empty() )
+      {
+      if( verbosity == 1 ) pp();
+      if( verbosity == 1 && workers < num_workers )
+        std::fprintf( stderr, "memory limit: %d threads, ", workers );
+      if( outfd >= 0 ) enlarge_pipe( outfd );
+      if( progress_fd >= 0 ) start_progress();
+      const int retval = decompress_mt( lzip_index, workers, infd, outfd, pp,
+                                        testing, sparse );
+      if( progress_fd >= 0 && retval == 0 )
+        { progress.member = lzip_index.members();	// also if testing
+          write_progress( "end", false, pp, cfile_size,
+                          lzip_index.udata_size(), lzip_index.cdata_size() ); }
+      return retval;
+      }
+    if( lseek( infd, 0, SEEK_SET ) != 0 )
+      { show_file_error( pp.name(), "Seek error", errno ); return 1; }
+    }
+
+  if( outfd >= 0 ) enlarge_pipe( outfd );
+  unsigned long long partial_file_pos = 0, data_pos = 0;
+  std::vector< uint8_t > rest;		// stream data already read
+
+  /* Skip the members of a stream before the range, or decode streams in
+     parallel while they are read. Anything unusual is left to the serial
+     decoder, starting at the first member not decoded. */
+  if( range )
+    {
+    const int retval = decompress_range_stream( *range, infd, outfd, pp,
+                         sparse, rest, partial_file_pos, data_pos );
+    if( retval >= 0 ) return retval;
+    }
+  else if( num_workers > 1 && ( from_stdin || cfile_size == 0 ) &&
+           verbosity < 2 && memory_limit == 0 )
+    {
+    if( progress_fd >= 0 ) start_progress();
+    const int retval = decompress_mt_stream( num_workers, infd, outfd, pp,
+                         testing, sparse, rest, partial_file_pos, data_pos );
+    if( progress_fd >= 0 && retval == 0 )
+      write_progress( "end", false, pp, cfile_size, data_pos,
+                      partial_file_pos );
+    if( retval >= 0 ) return retval;
+    }
+
+  // decode mapped data in place, or read them in a separate thread
+  Mmap_source msrc( infd, !async_io && rest.empty() );
+  Async_source asrc( infd );
+  Data_source & isrc = async_io ? (Data_source &)asrc : (Data_source &)msrc;
+  Prefix_source psrc( rest, isrc );
+  Range_decoder rdec( rest.empty() ? isrc : (Data_source &)psrc );
+  Fd_sink fsnk( outfd, sparse );
+  Async_sink asnk( outfd, sparse );
+  Data_sink & bsnk = async_io ? (Data_sink &)asnk : (Data_sink &)fsnk;
+  const Block no_range( 0, 0 );
+  Range_sink rsnk( bsnk, range ? *range : no_range, data_pos );
+  Data_sink & osnk = range ? (Data_sink &)rsnk : bsnk;
   int retval = 0;
   bool empty = false, multi = false;
 
-  for( bool first_member = true; ; first_member = false )
+  for( bool first_member = partial_file_pos == 0; ; first_member = false )
     {
     Lzip_header header;
     rdec.reset_member_position();
@@ -737,37 +1224,239 @@ int decompress( const unsigned long long cfile_size, const int infd,
     const unsigned dictionary_size = header.dictionary_size();
     if( !isvalid_ds( dictionary_size ) )
       { pp( bad_dict_msg ); retval = 2; break; }
+    if( decoder_workers( dictionary_size, 1 ) == 0 )
+      { pp( mem_limit_msg ); retval = 1; break; }
 
     if( verbosity >= 2 || ( verbosity == 1 && first_member ) ) pp();
 
-    LZ_decoder decoder( rdec, dictionary_size, outfd );
-    show_dprogress( cfile_size, partial_file_pos, &rdec, &pp );	// init
+    LZ_decoder decoder( rdec, dictionary_size, osnk, &dictionary_buffer );
+    show_dprogress( cfile_size, partial_file_pos, data_pos, &rdec, &decoder,
+                    &pp );					// init
     const int result = decoder.decode_member( pp );
     partial_file_pos += rdec.member_position();
     if( result != 0 )
-      {
-      if( verbosity >= 0 && result <= 2 )
-        {
-        pp();
-        std::fprintf( stderr, "%s at pos %llu\n", ( result == 2 ) ?
-                      "File ends unexpectedly" : "Decoder error",
-                      partial_file_pos );
-        }
-      else if( result == 5 ) pp( nonzero_msg );
-      retval = 2; break;
-      }
+      { show_member_error( pp, result, partial_file_pos ); retval = 2; break; }
     if( !from_stdin ) { multi = !first_member;
       if( decoder.data_position() == 0 ) empty = true; }
     if( verbosity >= 2 )
       { std::fputs( testing ? "ok\n" : "done\n", stderr ); pp.reset(); }
+    data_pos += decoder.data_position();
+    if( range && data_pos >= (unsigned long long)range->end() ) break;
     }
+  if( async_io && !asnk.flush() ) throw Error( wr_err_msg );
   if( verbosity == 1 && retval == 0 )
     std::fputs( testing ? "ok\n" : "done\n", stderr );
   if( empty && multi && retval == 0 )
     { show_file_error( pp.name(), empty_msg ); retval = 2; }
+  if( progress_fd >= 0 && retval == 0 )
+    write_progress( "end", false, pp, cfile_size, data_pos, partial_file_pos );
   return retval;
   }
 
+
+/* Append to 'files' the files found in directory 'dir' and its
+   subdirectories, in name order, that program_mode would process; the
+   files with a known extension when decompressing, testing, or listing,
+   and those without one (or all of them if recompress) when compressing.
+   Symbolic links are not followed. Return false if a directory can't be
+   read. */
+bool walk_directory( const std::string & dir, const Mode program_mode,
+                     const bool recompress, std::vector< std::string > & files )
+  {
+  DIR * const d = opendir( dir.c_str() );
+  if( !d )
+    { show_file_error( dir.c_str(), "Can't open directory", errno );
+      return false; }
+  std::vector< std::string > names;
+  for( const struct dirent * e; ( e = readdir( d ) ) != 0; )
+    if( std::strcmp( e->d_name, "." ) != 0 &&
+        std::strcmp( e->d_name, ".." ) != 0 ) names.push_back( e->d_name );
+  closedir( d );
+  std::sort( names.begin(), names.end() );
+  bool ok = true;
+  for( unsigned i = 0; i < names.size(); ++i )
+    {
+    std::string name( dir );
+    if( name.end()[-1] != '/' ) name += '/';
+    name += names[i];
+    struct stat st;
+    if( lstat( name.c_str(), &st ) != 0 )
+      { show_file_error( name.c_str(), "Can't stat input file", errno );
+        ok = false; continue; }
+    if( S_ISDIR( st.st_mode ) )
+      { if( !walk_directory( name, program_mode, recompress, files ) )
+          ok = false; }
+    else if( S_ISREG( st.st_mode ) &&
+             ( ( program_mode == m_compress && recompress ) ||
+               ( extension_index( name ) >= 0 ) != ( program_mode == m_compress ) ) )
+      files.push_back( name );
+    }
+  return ok;
+  }
+
+
+/* Replace the directories in filenames with the files found in them.
+   Return false if a directory can't be read. */
+bool expand_directories( std::vector< std::string > & filenames,
+                         const Mode program_mode, const bool recompress )
+  {
+  std::vector< std::string > files;
+  bool ok = true;
+  for( unsigned i = 0; i < filenames.size(); ++i )
+    {
+    struct stat st;
+    if( filenames[i] != "-" && stat( filenames[i].c_str(), &st ) == 0 &&
+        S_ISDIR( st.st_mode ) )
+      { if( !walk_directory( filenames[i], program_mode, recompress, files ) )
+          ok = false; }
+    else files.push_back( filenames[i] );
+    }
+  filenames.swap( files );
+  return ok;
+  }
+
+
+struct Greater_size
+  {
+  bool operator()( const std::pair< unsigned long long, std::string > & a,
+                   const std::pair< unsigned long long, std::string > & b ) const
+    { return a.first > b.first; }
+  };
+
+
+/* Sort files largest first, so that the longest jobs start first, and
+   return their sizes in 'sizes'. Files that can't be stat'ed sort last. */
+void sort_by_size( std::vector< std::string > & filenames,
+                   std::vector< unsigned long long > & sizes )
+  {
+  std::vector< std::pair< unsigned long long, std::string > > v;
+  for( unsigned i = 0; i < filenames.size(); ++i )
+    {
+    struct stat st;
+    const unsigned long long size =
+      ( stat( filenames[i].c_str(), &st ) == 0 ) ? st.st_size : 0;
+    v.push_back( std::make_pair( size, filenames[i] ) );
+    }
+  std::stable_sort( v.begin(), v.end(), Greater_size() );
+  sizes.resize( v.size() );
+  for( unsigned i = 0; i < v.size(); ++i )
+    { sizes[i] = v[i].first; filenames[i].swap( v[i].second ); }
+  }
+
+
+/* Process several files in parallel, each one (or each batch of small
+   files) in a child process that writes its messages to a temporary file.
+   The messages and exit statuses of the children are collected in the
+   order in which they were started, so that the output and the exit status
+   are the same as those of a serial run over the files in that order.
+   Children are started as slots become free, so a slow file does not hold
+   back the files after it. */
+class File_pool
+  {
+#if !defined __MSVCRT__ && !defined __DJGPP__
+  struct Child
+    {
+    std::string name;
+    std::FILE * f;		// messages of the child
+    pid_t pid;
+    int status;			// exit status, or -1 while running
+    };
+  std::deque< Child > children;		// in the order they were started
+  int running;
+#endif
+  const int max_running;
+  bool in_child_;
+
+public:
+  explicit File_pool( const int num_workers )
+    :
+#if !defined __MSVCRT__ && !defined __DJGPP__
+      running( 0 ), max_running( num_workers ),
+#else
+      max_running( 1 ),
+#endif
+      in_child_( false ) {}
+
+  bool active() const { return max_running > 1; }
+  bool in_child() const { return in_child_; }
+
+#if !defined __MSVCRT__ && !defined __DJGPP__
+  // wait for any child to exit
+  void reap()
+    {
+    int status;
+    const pid_t pid = waitpid( -1, &status, 0 );
+    if( pid < 0 ) { if( errno == EINTR ) return;
+      show_error( "Error waiting for child process", errno );
+      cleanup_and_fail( 1 ); }
+    for( unsigned i = 0; i < children.size(); ++i )
+      if( children[i].pid == pid )
+        {
+        if( WIFEXITED( status ) ) children[i].status = WEXITSTATUS( status );
+        else { children[i].status = 1 | 8;
+               if( std::fseek( children[i].f, 0, SEEK_END ) == 0 )
+                 std::fprintf( children[i].f, "%s: %s: Child process "
+                   "terminated by signal %d.\n", program_name,
+                   children[i].name.c_str(), WTERMSIG( status ) ); }
+        --running; break;
+        }
+    }
+
+  // print the messages of the leading children that have exited
+  void collect( int & retval, int & failed_tests )
+    {
+    while( !children.empty() && children.front().status >= 0 )
+      {
+      Child & c = children.front();
+      char buf[4096];
+      std::rewind( c.f );
+      for( size_t n; ( n = std::fread( buf, 1, sizeof buf, c.f ) ) > 0; )
+        std::fwrite( buf, 1, n, stderr );
+      std::fclose( c.f );
+      set_retval( retval, c.status & 7 );
+      if( c.status & 8 ) ++failed_tests;
+      children.pop_front();
+      }
+    }
+
+  /* Start a child process to process file 'name' (the first of its batch).
+     Return true in the child, or if the file must be processed here
+     because no child could be started. Return false in the parent after
+     starting the child. */
+  bool start_child( const std::string & name, int & retval,
+                    int & failed_tests )
+    {
+    while( running >= max_running ) { reap(); collect( retval, failed_tests ); }
+    std::FILE * const f = std::tmpfile();
+    const pid_t pid = f ? fork() : -1;
+    if( pid == 0 )					// child
+      {
+      in_child_ = true; retval = 0; failed_tests = 0;
+      if( dup2( fileno( f ), STDERR_FILENO ) < 0 ) _exit( 1 );
+      return true;
+      }
+    if( pid < 0 )		// process it here after the other files
+      { if( f ) std::fclose( f ); finish( retval, failed_tests ); return true; }
+    const Child c = { name, f, pid, -1 };
+    children.push_back( c ); ++running;
+    collect( retval, failed_tests );
+    return false;
+    }
+
+  // wait for all the children and print their messages
+  void finish( int & retval, int & failed_tests )
+    { while( running > 0 ) reap(); collect( retval, failed_tests ); }
+
+  // bit 3 of the exit status tells the parent that a test failed
+  void exit_child( const int retval, const int failed_tests )
+    { std::fflush( stderr ); _exit( retval | ( failed_tests ? 8 : 0 ) ); }
+#else
+  bool start_child( const std::string &, int &, int & ) { return true; }
+  void finish( int &, int & ) {}
+  void exit_child( const int, const int ) {}
+#endif
+  };
+
 } // end namespace
 
 
@@ -802,26 +1491,52 @@ void internal_error( const char * const msg )
   }
 
 
+// show the error returned by LZ_decoder::decode_member at file position pos
+void show_member_error( const Pretty_print & pp, const int result,
+                        const unsigned long long pos )
+  {
+  if( verbosity >= 0 && result <= 2 )
+    {
+    pp();
+    std::fprintf( stderr, "%s at pos %llu\n", ( result == 2 ) ?
+                  "File ends unexpectedly" : "Decoder error", pos );
+    }
+  else if( result == 5 ) pp( nonzero_msg );
+  }
+
+
 void show_cprogress( const unsigned long long cfile_size,
                      const unsigned long long partial_size,
-                     const Matchfinder_base * const m,
+                     const unsigned long long partial_out,
+                     const LZ_encoder_base * const e,
                      const Pretty_print * const p )
   {
   static unsigned long long csize = 0;		// file_size / 100
   static unsigned long long psize = 0;
-  static const Matchfinder_base * mb = 0;
+  static unsigned long long pout = 0;
+  static const LZ_encoder_base * encoder = 0;
   static const Pretty_print * pp = 0;
   static bool enabled = true;
+  static bool show = false;			// show progress on stderr
 
   if( !enabled ) return;
   if( p )					// initialize static vars
     {
-    if( verbosity < 2 || !isatty( STDERR_FILENO ) ) { enabled = false; return; }
-    csize = cfile_size; psize = partial_size; mb = m; pp = p;
+    show = verbosity >= 2 && isatty( STDERR_FILENO );
+    if( !show && progress_fd < 0 ) { enabled = false; return; }
+    csize = cfile_size; psize = partial_size; pout = partial_out;
+    encoder = e; pp = p;
+    if( !encoder ) return;		// file finished; ignore other coders
+    if( psize == 0 ) start_progress();
+    ++progress.member;
     }
-  if( mb && pp )
+  if( encoder && pp )
     {
-    const unsigned long long pos = psize + mb->data_position();
+    const unsigned long long pos = psize + encoder->data_position();
+    if( progress_fd >= 0 )
+      write_progress( "progress", true, *pp, csize, pos,
+                      pout + encoder->member_position() );
+    if( !show ) return;
     if( csize > 0 )
       std::fprintf( stderr, "%4llu%%  %.1f MB\r", pos / csize, pos / 1000000.0 );
     else
@@ -833,26 +1548,40 @@ void show_cprogress( const unsigned long long cfile_size,
 
 void show_dprogress( const unsigned long long cfile_size,
                      const unsigned long long partial_size,
+                     const unsigned long long partial_out,
                      const Range_decoder * const d,
+                     const LZ_decoder * const dec,
                      const Pretty_print * const p )
   {
   static unsigned long long csize = 0;		// file_size / 100
   static unsigned long long psize = 0;
+  static unsigned long long pout = 0;
   static const Range_decoder * rdec = 0;
+  static const LZ_decoder * decoder = 0;
   static const Pretty_print * pp = 0;
   static int counter = 0;
   static bool enabled = true;
+  static bool show = false;			// show progress on stderr
 
   if( !enabled ) return;
   if( p )					// initialize static vars
     {
-    if( verbosity < 2 || !isatty( STDERR_FILENO ) ) { enabled = false; return; }
-    csize = cfile_size; psize = partial_size; rdec = d; pp = p; counter = 0;
+    show = verbosity >= 2 && isatty( STDERR_FILENO );
+    if( !show && progress_fd < 0 ) { enabled = false; return; }
+    csize = cfile_size; psize = partial_size; pout = partial_out;
+    rdec = d; decoder = dec; pp = p; counter = 0;
+    if( !rdec ) return;			// file finished; ignore other coders
+    if( psize == 0 ) start_progress();
+    ++progress.member;
     }
   if( rdec && pp && --counter <= 0 )
     {
     const unsigned long long pos = psize + rdec->member_position();
     counter = 7;		// update display every 114688 bytes
+    if( progress_fd >= 0 )
+      write_progress( "progress", false, *pp, csize,
+                      pout + decoder->data_position(), pos );
+    if( !show ) return;
     if( csize > 0 )
       std::fprintf( stderr, "%4llu%%  %.1f MB\r", pos / csize, pos / 1000000.0 );
     else
@@ -862,41 +1591,71 @@ void show_dprogress( const unsigned long long cfile_size,
   }
 
 
+void show_mt_progress( const unsigned long long cfile_size,
+                       const unsigned long long udata,
+                       const unsigned long long cdata, const long member,
+                       const bool compressing, const Pretty_print & pp )
+  {
+  if( progress_fd < 0 ) return;
+  progress.member = member;
+  write_progress( "progress", compressing, pp, cfile_size, udata, cdata );
+  }
+
+
 int main( const int argc, const char * const argv[] )
   {
   /* Mapping from gzip/bzip2 style 0..9 compression levels to the
      corresponding LZMA compression parameters. */
   const Lzma_options option_mapping[] =
     {
-    { 1 << 16,  16 },		// -0
-    { 1 << 20,   5 },		// -1
-    { 3 << 19,   6 },		// -2
-    { 1 << 21,   8 },		// -3
-    { 3 << 20,  12 },		// -4
-    { 1 << 22,  20 },		// -5
-    { 1 << 23,  36 },		// -6
-    { 1 << 24,  68 },		// -7
-    { 3 << 23, 132 },		// -8
-    { 1 << 25, 273 } };		// -9
+    { 1 << 16,  16, false },	// -0
+    { 1 << 20,   5, false },	// -1
+    { 3 << 19,   6, false },	// -2
+    { 1 << 21,   8, false },	// -3
+    { 3 << 20,  12, false },	// -4
+    { 1 << 22,  20, false },	// -5
+    { 1 << 23,  36, false },	// -6
+    { 1 << 24,  68, false },	// -7
+    { 3 << 23, 132, false },	// -8
+    { 1 << 25, 273, false } };	// -9
+  /* Levels of '--fast=<n>', between -0 and -1 in speed. They use
+     HC_encoder, so that -s and -m still apply to them. */
+  const Lzma_options fast_mapping[] =
+    {
+    { 1 << 22,  64, true },	// --fast=1
+    { 1 << 21,  32, true },	// --fast=2
+    { 1 << 20,  16, true } };	// --fast=3
   Lzma_options encoder_options = option_mapping[6];	// default = "-6"
   const unsigned long long max_member_size = 0x0008000000000000ULL; // 2 PiB
   const unsigned long long max_volume_size = 0x4000000000000000ULL; // 4 EiB
   unsigned long long member_size = max_member_size;
   unsigned long long volume_size = 0;
+  const int max_workers = 1024;
+  int num_workers = 1;		// default is single-threaded
+  Block range( 0, 0 );		// decompressed bytes to write
+  bool range_given = false;
+  Auto_target auto_target;	// level of each file chosen from a sample
+  bool auto_given = false;
+  bool bench_tsv = false;		// machine-readable results of '--bench'
+#ifdef ENABLE_STATS
+  bool show_statistics = false;		// of the hot paths
+#endif
   std::string default_output_filename;
   Mode program_mode = m_compress;
   Cl_options cl_opts;		// command-line options
   bool force = false;
   bool keep_input_files = false;
   bool recompress = false;
+  bool recursive = false;
   bool to_stdout = false;
   bool zero = false;
   if( argc > 0 ) invocation_name = argv[0];
 
-  enum { opt_lt = 256 };
+  enum { opt_aio = 256, opt_app, opt_auto, opt_bench, opt_fast, opt_lt, opt_mi,
+         opt_ml, opt_pfd, opt_range, opt_rec, opt_sparse, opt_stats };
   const Arg_parser::Option options[] =
     {
-    { '0', "fast",              Arg_parser::no  },
+    { '0', 0,                   Arg_parser::no  },
     { '1', 0,                   Arg_parser::no  },
     { '2', 0,                   Arg_parser::no  },
     { '3', 0,                   Arg_parser::no  },
@@ -919,12 +1678,25 @@ int main( const int argc, const char * const argv[] )
     { 'n', "threads",           Arg_parser::yes },
     { 'o', "output",            Arg_parser::yes },
     { 'q', "quiet",             Arg_parser::no  },
+    { 'r', "recursive",         Arg_parser::no  },
     { 's', "dictionary-size",   Arg_parser::yes },
     { 'S', "volume-size",       Arg_parser::yes },
     { 't', "test",              Arg_parser::no  },
     { 'v', "verbose",           Arg_parser::no  },
     { 'V', "version",           Arg_parser::no  },
+    { opt_aio, "async-io",      Arg_parser::no  },
+    { opt_app, "append",        Arg_parser::no  },
+    { opt_auto, "auto",         Arg_parser::yes },
+    { opt_bench, "bench",       Arg_parser::maybe },
+    { opt_fast, "fast",         Arg_parser::maybe },
     { opt_lt, "loose-trailing", Arg_parser::no  },
+    { opt_mi, "make-index",     Arg_parser::no  },
+    { opt_ml, "memory-limit",   Arg_parser::yes },
+    { opt_pfd, "progress-fd",   Arg_parser::yes },
+    { opt_range, "range",       Arg_parser::yes },
+    { opt_rec, "recover",       Arg_parser::no  },
+    { opt_sparse, "sparse",     Arg_parser::no  },
+    { opt_stats, "stats",       Arg_parser::no  },
     { 0, 0,                     Arg_parser::no  } };
 
   const Arg_parser parser( argc, argv, options );
@@ -956,17 +1728,51 @@ int main( const int argc, const char * const argv[] )
       case 'm': encoder_options.match_len_limit =
                   getnum( arg, pn, min_match_len_limit, max_match_len );
                 zero = false; break;
-      case 'n': break;					// ignored
+      case 'n': num_workers = getnum( arg, pn, 1, max_workers ); break;
       case 'o': if( sarg == "-" ) to_stdout = true;
                 else { default_output_filename = sarg; } break;
       case 'q': verbosity = -1; break;
+      case 'r': recursive = true; break;
       case 's': encoder_options.dictionary_size = get_dict_size( arg, pn );
                 zero = false; break;
       case 'S': volume_size = getnum( arg, pn, 100000, max_volume_size ); break;
       case 't': set_mode( program_mode, m_test ); break;
       case 'v': if( verbosity < 4 ) ++verbosity; break;
       case 'V': show_version(); return 0;
+      case opt_aio: async_io = true; break;
+      case opt_app: append_output = true; break;
+      case opt_auto: parse_auto( arg, pn, auto_target ); auto_given = true;
+                break;
+      case opt_bench: set_mode( program_mode, m_bench );
+                if( sarg.empty() ) bench_tsv = false;
+                else if( sarg == "tsv" ) bench_tsv = true;
+                else { show_option_error( arg, "Invalid format in", pn );
+                       std::exit( 1 ); }
+                break;
+      case opt_fast: if( sarg.empty() )		// alias for -0
+                  { zero = true; encoder_options = option_mapping[0]; }
+                else { zero = false;
+                  encoder_options = fast_mapping[getnum( arg, pn, 1, 3 )-1]; }
+                break;
       case opt_lt: cl_opts.loose_trailing = true; break;
+      case opt_mi: cl_opts.make_index = true; break;
+      case opt_ml: memory_limit = getnum( arg, pn, 100000, max_member_size );
+                   break;
+      case opt_pfd: progress_fd = getnum( arg, pn, 0, INT_MAX );
+                if( fcntl( progress_fd, F_GETFD ) < 0 )
+                  { show_option_error( arg, "Bad file descriptor in", pn );
+                    return 1; } break;
+      case opt_range: set_mode( program_mode, m_decompress );
+                parse_range( arg, pn, range ); range_given = true; break;
+      case opt_rec: cl_opts.recover = true; break;
+      case opt_sparse: cl_opts.sparse = true; break;
+#ifdef ENABLE_STATS
+      case opt_stats: show_statistics = true; break;
+#else
+      case opt_stats: show_error( "Statistics not compiled in. "
+                        "Run 'configure --enable-stats' to enable them." );
+                return 1;
+#endif
       default: internal_error( "uncaught option." );
       }
     } // end process options
@@ -984,8 +1790,23 @@ int main( const int argc, const char * const argv[] )
     if( filenames.back() != "-" ) filenames_given = true;
     }
   if( filenames.empty() ) filenames.push_back("-");
+  if( recursive &&
+      !expand_directories( filenames, program_mode, recompress ) ) return 1;
 
-  if( program_mode == m_list ) return list_files( filenames, cl_opts );
+  if( program_mode == m_list )
+    return list_files( filenames, cl_opts, num_workers );
+  if( program_mode == m_bench )
+    {
+    dis_slots.init();
+    prob_prices.init();
+    const int retval =
+      bench_files( filenames, option_mapping, fast_mapping, member_size,
+                   bench_tsv );
+#ifdef ENABLE_STATS
+    if( show_statistics || verbosity >= 4 ) show_stats();
+#endif
+    return retval;
+    }
 
   if( program_mode == m_compress )
     {
@@ -993,10 +1814,13 @@ int main( const int argc, const char * const argv[] )
         filenames.size() > 1 )
       { show_error( "Only can compress one file when using '-o' and '-S'.",
                     0, true ); return 1; }
+    if( append_output && to_stdout )
+      { show_error( "Can't append to standard output.", 0, true ); return 1; }
     dis_slots.init();
     prob_prices.init();
     }
-  else volume_size = 0;
+  else { volume_size = 0; append_output = false; }
+  if( range_given && default_output_filename.empty() ) to_stdout = true;
   if( program_mode == m_test ) to_stdout = false;	// apply overrides
   if( program_mode == m_test || to_stdout ) default_output_filename.clear();
 
@@ -1008,26 +1832,70 @@ int main( const int argc, const char * const argv[] )
                        default_output_filename.size();
   if( !to_stdout && program_mode != m_test && ( filenames_given || to_file ) )
     set_signals( signal_handler );
-
-  Pretty_print pp( filenames );
+#if !defined __MSVCRT__ && !defined __OS2__ && !defined __DJGPP__
+  std::signal( SIGBUS, sigbus_handler );	// input files may be mapped
+#endif
 
   int failed_tests = 0;
   int retval = 0;
   const bool one_to_one = !to_stdout && program_mode != m_test && !to_file;
   bool stdin_used = false;
   struct stat in_stats;
+  File_pool pool( ( ( program_mode == m_test ||
+                      ( recursive && one_to_one && !append_output ) ) &&
+    filenames.size() > 1 &&
+    std::find( filenames.begin(), filenames.end(), std::string( "-" ) ) ==
+      filenames.end() ) ? num_workers : 1 );
+  /* With '-r', start the largest files first so that they don't delay the
+     end of the run. A file larger than its share of the total is processed
+     here with all the threads; the rest are processed by the children with
+     one thread each, in batches of about batch_size bytes. */
+  std::vector< unsigned long long > sizes;
+  unsigned num_large = 0;		// files processed here with num_workers
+  const unsigned long long batch_size = 1 << 20;
+  if( recursive && pool.active() )
+    {
+    sort_by_size( filenames, sizes );
+    unsigned long long total = 0;
+    for( unsigned i = 0; i < sizes.size(); ++i ) total += sizes[i];
+    while( num_large < sizes.size() &&
+           sizes[num_large] * num_workers > total ) ++num_large;
+    }
+  unsigned child_end = 0;		// end of the batch of the child
+
+  Pretty_print pp( filenames );
+
   for( unsigned i = 0; i < filenames.size(); ++i )
     {
+    if( pool.in_child() && i >= child_end ) break;	// end of batch
     std::string input_filename;
     int infd;
     const bool from_stdin = filenames[i] == "-";
 
     pp.set_name( filenames[i] );
+    if( pool.active() && !pool.in_child() && i >= num_large )
+      {
+      unsigned end = i + 1;
+      if( sizes.size() )			// batch the small files
+        for( unsigned long long sum = sizes[i];
+             end < sizes.size() && sum + sizes[end] <= batch_size; ++end )
+          sum += sizes[end];
+      if( !pool.start_child( filenames[i], retval, failed_tests ) )
+        { i = end - 1; continue; }
+      if( pool.in_child() )
+        { child_end = end; if( memory_limit > 0 )
+            memory_limit = std::max( memory_limit / num_workers, 100000ULL ); }
+      }
+    const int file_workers =
+      ( pool.active() && i >= num_large ) ? 1 : num_workers;
     if( from_stdin )
       {
       if( stdin_used ) continue; else stdin_used = true;
       infd = STDIN_FILENO;
       if( !check_tty_in( pp.name(), infd, program_mode, retval ) ) continue;
+      if( one_to_one && append_output )
+        { show_file_error( pp.name(), "Can't append to standard output." );
+          set_retval( retval, 1 ); continue; }
       if( one_to_one ) { outfd = STDOUT_FILENO; output_filename.clear(); }
       }
     else
@@ -1067,17 +1935,36 @@ int main( const int argc, const char * const argv[] )
     int tmp;
     try {
       if( program_mode == m_compress )
-        tmp = compress( cfile_size, member_size, volume_size, infd,
-                        encoder_options, pp, in_statsp, zero );
+        {
+        Lzma_options file_options = encoder_options;
+        bool file_zero = zero;
+        std::vector< uint8_t > prefix;		// sample read by '--auto'
+        if( auto_given && !choose_level( infd, option_mapping, auto_target,
+              file_workers, cfile_size * 100, member_size, file_options,
+              file_zero, prefix, pp ) ) tmp = 1;
+        else
+          tmp = compress( cfile_size, member_size, volume_size, infd,
+                          file_options, pp, in_statsp, file_workers, file_zero,
+                          prefix );
+        }
       else
-        tmp = decompress( cfile_size, infd, cl_opts, pp, from_stdin,
+        {
+        tmp = decompress( cfile_size, infd, cl_opts, pp,
+                          file_workers,
+                          range_given ? &range : 0, from_stdin,
                           program_mode == m_test );
+        if( tmp == 0 && cl_opts.sparse && program_mode != m_test &&
+            outfd >= 0 && sparse_ok( outfd ) && !finish_sparse( outfd ) )
+          throw Error( wr_err_msg );		// set size after a final hole
+        }
       }
     catch( std::bad_alloc & )
       { pp( ( program_mode == m_compress ) ?
             "Not enough memory. Try a smaller dictionary size." :
             "Not enough memory." ); tmp = 1; }
     catch( Error & e ) { pp(); show_error( e.msg, errno ); tmp = 1; }
+    show_cprogress( 0, 0, 0, 0, &pp );		// stop updating the progress
+    show_dprogress( 0, 0, 0, 0, 0, &pp );	// of the file just coded
     if( close( infd ) != 0 )
       { show_file_error( pp.name(), "Error closing input file", errno );
         set_retval( tmp, 1 ); }
@@ -1087,14 +1974,29 @@ int main( const int argc, const char * const argv[] )
         else ++failed_tests; }
 
     if( delete_output_on_interrupt && one_to_one )
-      close_and_set_permissions( in_statsp );
+      {
+      close_and_set_permissions( ( append_size < 0 ) ? in_statsp : 0 );
+      if( program_mode == m_compress && cl_opts.make_index && volume_size == 0 )
+        set_retval( retval, make_sidecar( cl_opts ) );
+      }
     if( input_filename.size() && !keep_input_files && one_to_one &&
         ( program_mode != m_compress || volume_size == 0 ) )
+      {
       std::remove( input_filename.c_str() );
+      if( program_mode != m_compress )		// the index is now useless
+        std::remove( sidecar_name( input_filename.c_str() ).c_str() );
+      }
     }
+  if( pool.in_child() ) pool.exit_child( retval, failed_tests );
+  pool.finish( retval, failed_tests );
   if( delete_output_on_interrupt )					// -o
+    {
     close_and_set_permissions( ( retval == 0 && !stdin_used &&
-      filenames_given && filenames.size() == 1 ) ? &in_stats : 0 );
+      filenames_given && filenames.size() == 1 && append_size < 0 ) ?
+      &in_stats : 0 );
+    if( program_mode == m_compress && cl_opts.make_index && volume_size == 0 )
+      set_retval( retval, make_sidecar( cl_opts ) );
+    }
   else if( outfd >= 0 && close( outfd ) != 0 )				// -c
     {
     show_error( "Error closing stdout", errno );
@@ -1104,5 +2006,8 @@ int main( const int argc, const char * const argv[] )
     std::fprintf( stderr, "%s: warning: %d %s failed the test.\n",
                   program_name, failed_tests,
                   ( failed_tests == 1 ) ? "file" : "files" );
+#ifdef ENABLE_STATS
+  if( show_statistics || verbosity >= 4 ) show_stats();
+#endif
   return retval;
   }
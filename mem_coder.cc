@@ -0,0 +1,207 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   Compression and decompression between arbitrary sources and sinks, and
+   from buffer to buffer, without file descriptors or diagnostics.
+   Data_source::read and Data_sink::write report errors by returning a
+   short count; other failures are reported through the return value.
+   Memory allocation failures throw std::bad_alloc. dis_slots.init() and
+   prob_prices.init() must be called once before compressing.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "lzip.h"
+#include "decoder.h"
+#include "encoder_base.h"
+#include "encoder.h"
+#include "fast_encoder.h"
+#include "hc_encoder.h"
+
+
+namespace {
+
+LZ_encoder_base * new_encoder( const Lzma_options & options, const bool zero,
+                               Data_source & src, Data_sink & snk )
+  {
+  if( zero ) return new FLZ_encoder( src, snk );
+  if( options.lazy ) return new HC_encoder( options.dictionary_size,
+                                            options.match_len_limit, src, snk );
+  return new LZ_encoder( options.dictionary_size, options.match_len_limit,
+                         src, snk );
+  }
+
+} // end namespace
+
+
+/* Return the bytes allocated at most by the encoder that new_encoder
+   would create, to check them against the memory limit. */
+unsigned long long encoder_memory( const Lzma_options & options,
+                                   const bool zero )
+  {
+  if( zero ) return FLZ_encoder::memory_needed();
+  if( options.lazy ) return HC_encoder::memory_needed( options.dictionary_size );
+  return LZ_encoder::memory_needed( options.dictionary_size );
+  }
+
+
+// Return the bytes allocated by a decoder with its input buffer.
+unsigned long long decoder_memory( const unsigned dictionary_size )
+  { return sizeof (LZ_decoder) + sizeof (Range_decoder) + 16384 +
+           (unsigned long long)dictionary_size; }
+
+
+Encoder_pool::~Encoder_pool()
+  {
+  for( unsigned i = 0; i < entries.size(); ++i ) delete entries[i].encoder;
+  }
+
+
+LZ_encoder_base * Encoder_pool::get( const Lzma_options & options,
+                                     const bool zero, Data_source & src,
+                                     Data_sink & snk )
+  {
+  for( unsigned i = 0; i < entries.size(); ++i )
+    {
+    Entry & e = entries[i];
+    if( !e.in_use && e.zero == zero && ( zero ||
+        ( e.options.dictionary_size == options.dictionary_size &&
+          e.options.match_len_limit == options.match_len_limit &&
+          e.options.lazy == options.lazy ) ) )
+      { e.encoder->reset_stream( src, snk ); e.in_use = true;
+        return e.encoder; }
+    }
+  Entry e;
+  e.encoder = new_encoder( options, zero, src, snk );
+  e.options = options; e.zero = zero; e.in_use = true;
+  entries.push_back( e );
+  return e.encoder;
+  }
+
+
+void Encoder_pool::release( LZ_encoder_base * const encoder )
+  {
+  for( unsigned i = 0; i < entries.size(); ++i )
+    if( entries[i].encoder == encoder ) { entries[i].in_use = false; return; }
+  delete encoder;				// not from this pool
+  }
+
+
+void Encoder_pool::free_idle()
+  {
+  unsigned j = 0;
+  for( unsigned i = 0; i < entries.size(); ++i )
+    if( entries[i].in_use ) entries[j++] = entries[i];
+    else delete entries[i].encoder;
+  entries.resize( j );
+  }
+
+
+/* Compress all the data from src into members of at most member_size
+   bytes. If zero, use the fast encoder of level -0 and ignore options;
+   else, if options.lazy, use the encoder of the levels of '--fast=<n>'.
+   If pool, take the encoder from it and return it there afterwards.
+   Return 0 if OK, 1 if I/O error, 3 if internal error. */
+int compress_data( Data_source & src, Data_sink & snk,
+                   const Lzma_options & options,
+                   const unsigned long long member_size, const bool zero,
+                   unsigned long long * const memory,
+                   Encoder_pool * const pool )
+  {
+  LZ_encoder_base * encoder = 0;		// polymorphic encoder
+  int retval = 0;
+  try {		// the constructor already reads the first block of data
+    if( pool ) encoder = pool->get( options, zero, src, snk );
+    else encoder = new_encoder( options, zero, src, snk );
+    while( true )		// encode one member per iteration
+      {
+      if( !encoder->encode_member( member_size ) ) { retval = 3; break; }
+      if( encoder->data_finished() ) break;
+      encoder->reset();
+      }
+    }
+  catch( Error & ) { retval = 1; }
+  if( !encoder ) return retval;
+  if( memory ) *memory = encoder->memory_size() +
+    ( zero ? sizeof (FLZ_encoder) :
+      options.lazy ? sizeof (HC_encoder) : sizeof (LZ_encoder) );
+  if( pool ) pool->release( encoder ); else delete encoder;
+  return retval;
+  }
+
+
+/* Decompress all the members from src. Trailing data are ignored unless
+   they look like a corrupt header. Return 0 if OK, 1 if I/O error,
+   2 if the data are not a valid lzip stream. */
+int decompress_data( Data_source & src, Data_sink & snk,
+                     unsigned * const max_dictionary_size )
+  {
+  const std::vector< std::string > no_names;
+  const Pretty_print pp( no_names );		// not used; quiet decoder
+  Range_decoder rdec( src );
+  Dictionary_buffer dbuf;
+  if( max_dictionary_size ) *max_dictionary_size = 0;
+
+  try {
+    for( bool first_member = true; ; first_member = false )
+      {
+      Lzip_header header;
+      rdec.reset_member_position();
+      const int size = rdec.read_data( header.data, header.size );
+      if( rdec.finished() )			// End Of File
+        return ( first_member || header.check_prefix( size ) ) ? 2 : 0;
+      if( !header.check_magic() )
+        return ( first_member || header.check_corrupt() ) ? 2 : 0;
+      const unsigned dictionary_size = header.dictionary_size();
+      if( !header.check_version() || !isvalid_ds( dictionary_size ) )
+        return 2;
+      if( max_dictionary_size && *max_dictionary_size < dictionary_size )
+        *max_dictionary_size = dictionary_size;
+      LZ_decoder decoder( rdec, dictionary_size, snk, &dbuf );
+      if( decoder.decode_member( pp, true ) != 0 ) return 2;
+      }
+    }
+  catch( Error & ) { return 1; }
+  }
+
+
+int compress_buffer( const uint8_t * const inbuf, const long insize,
+                     std::vector< uint8_t > & outbuf,
+                     const Lzma_options & options,
+                     const unsigned long long member_size, const bool zero )
+  {
+  Mem_source src( inbuf, insize );
+  Mem_sink snk( outbuf );
+  return compress_data( src, snk, options, member_size, zero );
+  }
+
+
+int decompress_buffer( const uint8_t * const inbuf, const long insize,
+                       std::vector< uint8_t > & outbuf )
+  {
+  Mem_source src( inbuf, insize );
+  Mem_sink snk( outbuf );
+  return decompress_data( src, snk );
+  }
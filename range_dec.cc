@@ -0,0 +1,128 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "lzip.h"
+#include "decoder.h"
+#include "lzip_index.h"
+
+
+/* Decompress only the members of the file that contain bytes of range,
+   and write only those bytes. The members are found with the index, so
+   the members before the range are neither read nor decoded.
+   Return value: 0 = OK, 1 = I/O error, 2 = data error. */
+int decompress_range( const Lzip_index & lzip_index, const Block & range,
+                      const int infd, const int outfd,
+                      const Pretty_print & pp, const bool sparse )
+  {
+  if( verbosity >= 1 ) pp();
+  if( lseek( infd, 0, SEEK_SET ) != 0 )
+    { show_file_error( pp.name(), "Seek error", errno ); return 1; }
+  Mmap_source msrc( infd );	// decode members in place if mapped
+  int map_size;
+  const uint8_t * const map = msrc.contents( map_size );
+  Fd_sink osnk( outfd, sparse );
+  Dictionary_buffer dbuf;
+
+  for( long i = 0; i < lzip_index.members(); ++i )
+    {
+    const Block & db = lzip_index.dblock( i );
+    if( db.end() <= range.pos() ) continue;
+    if( db.pos() >= range.end() ) break;
+    const Block & mb = lzip_index.mblock( i );
+    Pread_source psrc( infd, mb.pos(), mb.size() );
+    Mem_source isrc( map ? map + mb.pos() : 0, map ? mb.size() : 0 );
+    Range_decoder rdec( map ? (Data_source &)isrc : (Data_source &)psrc );
+    Lzip_header header;			// already checked by Lzip_index
+    rdec.read_data( header.data, header.size );
+    Range_sink rsnk( osnk, range, db.pos() );
+    LZ_decoder decoder( rdec, lzip_index.dictionary_size( i ), rsnk, &dbuf );
+    const int result = decoder.decode_member( pp );
+    if( result != 0 )
+      { show_member_error( pp, result, mb.pos() + rdec.member_position() );
+        return 2; }
+    }
+  if( verbosity >= 1 ) std::fputs( "done\n", stderr );
+  return 0;
+  }
+
+
+/* Decompress only the bytes of range from a non-seekable stream. The
+   members before the range are found with Stream_scanner and skipped
+   without decoding them, and the members that contain bytes of range are
+   decoded from memory. As in decompress_mt_stream, anything unusual is left
+   to the serial decoder, which decodes the rest of the stream starting at
+   'rest_pos' (data position 'rest_dpos') from the bytes in 'rest'.
+   Return value: 0 = OK, 2 = data error, -1 = decode the rest serially. */
+int decompress_range_stream( const Block & range, const int infd,
+                             const int outfd, const Pretty_print & pp,
+                             const bool sparse, std::vector< uint8_t > & rest,
+                             unsigned long long & rest_pos,
+                             unsigned long long & rest_dpos )
+  {
+  enum { max_member_size = 1 << 27 };
+  if( verbosity >= 1 ) pp();
+  Fd_source fsrc( infd );
+  Stream_scanner scanner( fsrc, true );
+  Fd_sink osnk( outfd, sparse );
+  std::vector< uint8_t > member;
+  Dictionary_buffer dbuf;
+  long long dpos = 0;			// data position of the next member
+  while( dpos < range.end() )
+    {
+    Lzip_header header;
+    Stream_scanner::Result res = scanner.read_header( header );
+    if( res == Stream_scanner::found )
+      res = header.check() ? scanner.find_member_end( max_member_size )
+                           : Stream_scanner::truncated;	// not a member
+    if( res == Stream_scanner::read_error )
+      { errno = scanner.read_errno(); throw Error( "Read error" ); }
+    if( res == Stream_scanner::eof && dpos > 0 ) break;	// range past EOF
+    if( res != Stream_scanner::found )
+      { rest_pos = scanner.mpos(); rest_dpos = dpos;
+        scanner.take_rest( rest ); return -1; }
+    const long long mpos = scanner.mpos();
+    const long long dsize = scanner.dsize();
+    const bool needed = dpos + dsize > range.pos();
+    scanner.take_member( needed ? &member : 0 );
+    if( needed )
+      {
+      Mem_source isrc( &member[0], member.size() );
+      Range_decoder rdec( isrc );
+      rdec.read_data( header.data, header.size );
+      Range_sink rsnk( osnk, range, dpos );
+      LZ_decoder decoder( rdec, header.dictionary_size(), rsnk, &dbuf );
+      const int result = decoder.decode_member( pp );
+      if( result != 0 )
+        { show_member_error( pp, result, mpos + rdec.member_position() );
+          return 2; }
+      }
+    dpos += dsize;
+    }
+  if( verbosity >= 1 ) std::fputs( "done\n", stderr );
+  return 0;
+  }
@@ -0,0 +1,137 @@
+/* Lzip - LZMA lossless data compressor
+   Copyright (C) 2008-2025 Antonio Diaz Diaz.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+   Counters of the hot paths of the coders. The counters are shared by
+   all the threads and updated with relaxed atomic additions, so they only
+   slow down the builds configured with '--enable-stats'. Times are given
+   in CPU cycles where the time stamp counter is available, else in ns.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+#include "lzip.h"
+
+#ifdef ENABLE_STATS
+
+namespace {
+
+struct Phase_stats
+  {
+  unsigned long long ticks;
+  unsigned long long calls;
+  unsigned long long bytes;
+  unsigned long long syscalls;
+  };
+
+Phase_stats phase_stats[num_stats_phases];
+unsigned long long literals;
+unsigned long long len_counts[2][num_len_buckets];	// [rep][bucket]
+
+const char * const phase_names[num_stats_phases] =
+  { "match finding", "optimal parsing", "distance prices",
+    "length prices", "align prices", "range encoding", "decoding", "CRC",
+    "read", "write" };
+
+void add( unsigned long long & counter, const unsigned long long value )
+  { __atomic_fetch_add( &counter, value, __ATOMIC_RELAXED ); }
+
+unsigned long long get( const unsigned long long & counter )
+  { return __atomic_load_n( &counter, __ATOMIC_RELAXED ); }
+
+int len_bucket( const int len )
+  {
+  if( len <= 4 ) return len - 1;
+  int bucket = 4;
+  for( int n = ( len - 1 ) >> 3; n > 0 && bucket < num_len_buckets - 1;
+       n >>= 1 ) ++bucket;
+  return bucket;
+  }
+
+} // end namespace
+
+
+#if defined __GNUC__ && ( defined __x86_64__ || defined __i386__ )
+const char * const ticks_name = "cycles";
+unsigned long long stats_ticks() { return __builtin_ia32_rdtsc(); }
+#else
+const char * const ticks_name = "ns";
+unsigned long long stats_ticks()
+  {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+#endif
+
+
+void stats_add( const Stats_phase phase, const unsigned long long ticks,
+                const unsigned long long bytes, const unsigned long syscalls )
+  {
+  Phase_stats & ps = phase_stats[phase];
+  add( ps.ticks, ticks ); add( ps.calls, 1 );
+  if( bytes ) add( ps.bytes, bytes );
+  if( syscalls ) add( ps.syscalls, syscalls );
+  }
+
+
+void stats_sequence( const int len, const bool rep )
+  {
+  if( len <= 0 ) add( literals, 1 );
+  else add( len_counts[rep][len_bucket( len )], 1 );
+  }
+
+
+void show_stats()
+  {
+  std::fprintf( stderr, "\nphase             %13s          calls          bytes"
+                "   syscalls  bytes/call\n", ticks_name );
+  for( int i = 0; i < num_stats_phases; ++i )
+    {
+    const Phase_stats & ps = phase_stats[i];
+    if( get( ps.calls ) == 0 ) continue;
+    std::fprintf( stderr, "%-17s %13llu %14llu", phase_names[i],
+                  get( ps.ticks ), get( ps.calls ) );
+    if( get( ps.bytes ) || get( ps.syscalls ) ) std::fprintf( stderr, " %14llu", get( ps.bytes ) );
+    if( get( ps.syscalls ) )
+      std::fprintf( stderr, " %10llu %11llu", get( ps.syscalls ),
+                    get( ps.bytes ) / get( ps.syscalls ) );
+    std::fputc( '\n', stderr );
+    }
+  unsigned long long sequences = get( literals );
+  for( int i = 0; i < num_len_buckets; ++i )
+    sequences += get( len_counts[0][i] ) + get( len_counts[1][i] );
+  if( sequences == 0 ) return;			// nothing compressed
+  const char * const bucket_names[num_len_buckets] =
+    { "1", "2", "3", "4", "5-8", "9-16", "17-32", "33-64", "65-128",
+      "129-273" };
+  std::fprintf( stderr, "\nliterals %llu\nlength          matches"
+                "           reps\n", get( literals ) );
+  for( int i = 0; i < num_len_buckets; ++i )
+    std::fprintf( stderr, "%-8s %14llu %14llu\n", bucket_names[i],
+                  get( len_counts[0][i] ), get( len_counts[1][i] ) );
+  }
+
+#endif
@@ -0,0 +1,104 @@
+#! /bin/sh
+# benchmark script for Lzip - LZMA lossless data compressor
+# Copyright (C) 2008-2025 Antonio Diaz Diaz.
+#
+# This script is free software: you have unlimited permission
+# to copy, distribute, and modify it.
+#
+# Usage: bench.sh testdir version [exeext [baseline [tolerance]]]
+# Writes the results of 'lzip --bench=tsv' on the generated corpora to
+# bench.tsv, and if baseline is given, compares them with it, allowing the
+# speeds to drop by tolerance percent (10 by default).
+
+LC_ALL=C
+export LC_ALL
+objdir=`pwd`
+testdir=`cd "$1" ; pwd`
+LZIP="${objdir}"/lzip$3
+baseline="$4"
+tolerance="${5:-10}"
+results="${objdir}"/bench.tsv
+framework_failure() { echo "failure in benchmark framework" ; exit 1 ; }
+# Write the bytes given as lines of octal escapes. Not all versions of awk
+# can write a NUL byte, but printf(1) can.
+unescape() { while IFS= read -r line ; do printf "${line}" ; done ; }
+
+if [ ! -f "${LZIP}" ] || [ ! -x "${LZIP}" ] ; then
+	echo "${LZIP}: cannot execute"
+	exit 1
+fi
+if [ -n "${baseline}" ] && [ ! -f "${baseline}" ] ; then
+	echo "${baseline}: baseline not found"
+	exit 1
+fi
+
+if [ -d tmp_bench ] ; then rm -rf tmp_bench ; fi
+mkdir tmp_bench
+cd "${objdir}"/tmp_bench || framework_failure
+
+# The corpora are generated with a Park-Miller generator, which is exact in
+# the double precision arithmetic of awk, so that they are the same on all
+# systems.
+printf "generating corpora..."
+# text: words of test.txt in random order
+tr -s ' \n' '\n\n' < "${testdir}"/test.txt |
+awk 'BEGIN { x = 1 }
+  { if( $0 != "" ) w[n++] = $0 }
+  END { len = 0
+    while( total < 1048576 ) {
+      x = ( x * 16807 ) % 2147483647 ; s = w[x % n]
+      if( len + length( s ) >= 72 ) { printf "\n" ; total += len + 1 ; len = 0 }
+      else if( len > 0 ) { printf " " ; ++len }
+      printf "%s", s ; len += length( s ) } }' > text || framework_failure
+# binary: 16-byte records with a counter, a small value, and a type name
+awk 'BEGIN { x = 1 ; split( "alpha beta gamma delta", t, " " )
+  for( i = 0; i < 65536; ++i ) {
+    x = ( x * 16807 ) % 2147483647 ; v = x % 1000
+    printf "\\%o\\%o\\0\\0", i % 256, int( i / 256 ) % 256
+    printf "\\%o\\%o\\0\\0", v % 256, int( v / 256 )
+    printf "%-8s", t[x % 4 + 1]
+    if( i % 128 == 127 ) printf "\n" } }' | unescape > binary ||
+	framework_failure
+# incompressible: the high bits of the generator
+awk 'BEGIN { x = 1
+  for( i = 0; i < 1048576; ++i ) {
+    x = ( x * 16807 ) % 2147483647 ; printf "\\%o", int( x / 8388608 )
+    if( i % 512 == 511 ) printf "\n" } }' | unescape > random ||
+	framework_failure
+# highly repetitive: test.txt repeated
+i=0
+while [ $i -lt 29 ] ; do
+	cat "${testdir}"/test.txt || framework_failure
+	i=`expr $i + 1`
+done > repeat
+echo " done"
+
+printf "benchmarking lzip-%s (this takes a few minutes)...\n" "$2"
+"${LZIP}" --bench=tsv text binary random repeat > "${results}" ||
+	framework_failure
+cat "${results}"
+echo "results written to ${results}"
+
+cd "${objdir}" || framework_failure
+rm -rf tmp_bench
+[ -n "${baseline}" ] || exit 0
+
+# compressed size must not grow; speed must not drop more than tolerance
+awk -F '	' -v min=`expr 100 - "${tolerance}"` 'BEGIN { min /= 100 }
+  function option( level ) { return ( level ~ /^fast/ ? "--" : "-" ) level }
+  FNR == 1 && NR != 1 { new = 1 }
+  /^#/ { next }
+  !new { csize[$1 " " $3] = $4 ; cspeed[$1 " " $3] = $5
+         dspeed[$1 " " $3] = $6 ; next }
+  { k = $1 " " $3 ; if( !( k in csize ) ) next
+    o = $1 " " option( $3 )
+    if( $4 > csize[k] )
+      { printf "%s: csize %s -> %s\n", o, csize[k], $4 ; ++bad }
+    if( $5 < min * cspeed[k] )
+      { printf "%s: comp MB/s %s -> %s\n", o, cspeed[k], $5 ; ++bad }
+    if( $6 < min * dspeed[k] )
+      { printf "%s: decomp MB/s %s -> %s\n", o, dspeed[k], $6 ; ++bad } }
+  END { if( bad ) { printf "%d %s against baseline.\n", bad,
+                      ( bad == 1 ) ? "regression" : "regressions" ; exit 1 }
+        print "no regressions against baseline." }' \
+	"${baseline}" "${results}"
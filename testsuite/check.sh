@@ -11,6 +11,9 @@ objdir=`pwd`
 testdir=`cd "$1" ; pwd`
 LZIP="${objdir}"/lzip$3
 framework_failure() { echo "failure in testing framework" ; exit 1 ; }
+# Write the bytes given as lines of octal escapes. Not all versions of awk
+# can write a NUL byte, but printf(1) can.
+unescape() { while IFS= read -r line ; do printf "${line}" ; done ; }
 
 if [ ! -f "${LZIP}" ] || [ ! -x "${LZIP}" ] ; then
 	echo "${LZIP}: cannot execute"
@@ -48,6 +51,8 @@ for i in bad_size -1 0 4095 513MiB 1G 1T 1P 1E 1Z 1Y 10KB ; do
 	[ $? = 1 ] || test_failed $LINENO $i
 	[ ! -e in.lz ] || test_failed $LINENO $i
 done
+"${LZIP}" -q --bench=csv in
+[ $? = 1 ] || test_failed $LINENO
 "${LZIP}" -lq in
 [ $? = 2 ] || test_failed $LINENO
 "${LZIP}" -tq in
@@ -304,6 +309,17 @@ for i in s4Ki 0 1 2 3 4 5 6 7 8 9 ; do
 	cmp in copy || test_failed $LINENO $i
 done
 rm -f copy out.lz || framework_failure
+for i in 1 2 3 ; do
+	"${LZIP}" --fast=$i -c in > out || test_failed $LINENO $i
+	"${LZIP}" -cd out | cmp in - || test_failed $LINENO $i
+	"${LZIP}" --fast=$i -s4Ki -m5 < in | "${LZIP}" -d | cmp in - ||
+		test_failed $LINENO $i
+done
+"${LZIP}" -q --fast=4 -c in > out
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -0 -c in > out || test_failed $LINENO
+"${LZIP}" --fast -c in | cmp out - || test_failed $LINENO	# alias for -0
+rm -f out || framework_failure
 
 cat in in in in in in in in > in8 || framework_failure
 "${LZIP}" -1s12 -S100k in8 || test_failed $LINENO
@@ -342,7 +358,297 @@ rm -f in8.lz00001.lz in8.lz00002.lz || framework_failure
 "${LZIP}" -0kF -b100k in8.lz || test_failed $LINENO
 "${LZIP}" -t in8.lz.lz || test_failed $LINENO
 "${LZIP}" -cd in8.lz.lz | cmp in8.lz - || test_failed $LINENO
-rm -f in8.lz in8.lz.lz || framework_failure
+rm -f in8.lz.lz || framework_failure
+"${LZIP}" -cd in8.lz > in8 || test_failed $LINENO
+for i in 0 1 ; do
+	"${LZIP}" -$i -s4Ki -n4 -c in8 > out.lz || test_failed $LINENO $i
+	lines=`"${LZIP}" -lvv out.lz | wc -l` || test_failed $LINENO $i
+	[ "${lines}" -gt 4 ] || test_failed $LINENO "$i ${lines}"	# multimember
+	"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO $i
+	"${LZIP}" -$i -s4Ki -n4 -b100k < in8 > out.lz || test_failed $LINENO $i
+	"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO $i
+	"${LZIP}" -n4 -t out.lz || test_failed $LINENO $i
+	"${LZIP}" -n4 -cd out.lz | cmp in8 - || test_failed $LINENO $i
+done
+"${LZIP}" -n4 -tq in8.lz || test_failed $LINENO
+"${LZIP}" -n4 -cdq in8.lz | cmp in8 - || test_failed $LINENO
+# errors are reported as by the serial decoder
+"${LZIP}" -t "${testdir}"/fox6_mark.lz 2> copy
+"${LZIP}" -n4 -t "${testdir}"/fox6_mark.lz 2> out
+[ $? = 2 ] || test_failed $LINENO
+cmp copy out || test_failed $LINENO
+"${LZIP}" -cdq "${testdir}"/fox6_mark.lz > copy
+"${LZIP}" -n4 -cdq "${testdir}"/fox6_mark.lz > out
+[ $? = 2 ] || test_failed $LINENO
+cmp copy out || test_failed $LINENO
+# several files are tested and listed in parallel, in order
+for i in -q "" -v -vv ; do
+	"${LZIP}" -t $i "${in_lz}" "${testdir}"/fox6_mark.lz nx_file.lz \
+		"${testdir}"/fox_bcrc.lz "${fox_lz}" 2> copy
+	r1=$?
+	"${LZIP}" -n3 -t $i "${in_lz}" "${testdir}"/fox6_mark.lz nx_file.lz \
+		"${testdir}"/fox_bcrc.lz "${fox_lz}" 2> out
+	[ $? = ${r1} ] || test_failed $LINENO "$i"
+	cmp copy out || test_failed $LINENO "$i"
+	"${LZIP}" -l $i "${in_lz}" in8.lz nx_file.lz "${testdir}"/fox6.lz \
+		"${fox_lz}" > copy 2>&1
+	r1=$?
+	"${LZIP}" -n3 -l $i "${in_lz}" in8.lz nx_file.lz "${testdir}"/fox6.lz \
+		"${fox_lz}" > out 2>&1
+	[ $? = ${r1} ] || test_failed $LINENO "$i"
+	cmp copy out || test_failed $LINENO "$i"
+done
+# stdin repeated more times than the workers index ahead
+"${LZIP}" -l - - - - - - - - - - - in8.lz < "${in_lz}" > copy ||
+	test_failed $LINENO
+"${LZIP}" -n2 -l - - - - - - - - - - - in8.lz < "${in_lz}" > out ||
+	test_failed $LINENO
+cmp copy out || test_failed $LINENO
+# decompress a range of bytes spanning several members
+"${LZIP}" -0 -b100k -c in8 > out.lz || test_failed $LINENO
+"${LZIP}" --range=90000-210000 out.lz > out || test_failed $LINENO
+tail -c +90001 in8 | head -c 120000 | cmp - out || test_failed $LINENO
+"${LZIP}" --range=123456,10 out.lz > out || test_failed $LINENO
+tail -c +123457 in8 | head -c 10 | cmp - out || test_failed $LINENO
+"${LZIP}" --range=250000- out.lz > out || test_failed $LINENO
+tail -c +250001 in8 | cmp - out || test_failed $LINENO
+# streams are indexed, cut and decoded in parallel as they are read
+cat out.lz | "${LZIP}" --range=90000-210000 > out || test_failed $LINENO
+tail -c +90001 in8 | head -c 120000 | cmp - out || test_failed $LINENO
+cat out.lz | "${LZIP}" --range=250000- > out || test_failed $LINENO
+tail -c +250001 in8 | cmp - out || test_failed $LINENO
+"${LZIP}" -lvv out.lz | sed -e 's/out.lz/(stdin)/' > copy || test_failed $LINENO
+cat out.lz | "${LZIP}" -lvv > out || test_failed $LINENO
+cmp copy out || test_failed $LINENO
+cat out.lz | "${LZIP}" -n4 -d | cmp in8 - || test_failed $LINENO
+cat out.lz | "${LZIP}" -n4 -t || test_failed $LINENO
+cat out.lz "${testdir}"/fox6_mark.lz | "${LZIP}" -t 2> copy
+cat out.lz "${testdir}"/fox6_mark.lz | "${LZIP}" -n4 -t 2> out
+[ $? = 2 ] || test_failed $LINENO
+cmp copy out || test_failed $LINENO
+cat out.lz in8 | "${LZIP}" -q -n4 -d --trailing-error > out
+[ $? = 2 ] || test_failed $LINENO
+cmp in8 out || test_failed $LINENO
+[ -e out.lz ] || test_failed $LINENO
+"${LZIP}" -q --range=100 out.lz
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -q --range=0-10 in8
+[ $? = 2 ] || test_failed $LINENO
+# sidecar index
+"${LZIP}" -0 -b100k -c in8 > out.lz || test_failed $LINENO
+"${LZIP}" -lvv out.lz > copy || test_failed $LINENO
+"${LZIP}" -l --make-index out.lz > /dev/null || test_failed $LINENO
+[ -e out.lz.lzidx ] || test_failed $LINENO
+"${LZIP}" -lvv out.lz > out || test_failed $LINENO
+cmp copy out || test_failed $LINENO
+"${LZIP}" -n4 -cd out.lz | cmp in8 - || test_failed $LINENO
+"${LZIP}" -0 -c in > out.lz || test_failed $LINENO	# stale index
+"${LZIP}" -cd out.lz | cmp in - || test_failed $LINENO
+"${LZIP}" -l out.lz > /dev/null || test_failed $LINENO
+rm -f out.lz out.lz.lzidx || framework_failure
+cp in8 out || framework_failure
+"${LZIP}" -0 -b100k --make-index out || test_failed $LINENO
+[ -e out.lz.lzidx ] || test_failed $LINENO
+"${LZIP}" -lvv out.lz | cmp copy - || test_failed $LINENO
+"${LZIP}" -d out.lz || test_failed $LINENO
+[ ! -e out.lz.lzidx ] || test_failed $LINENO
+cmp in8 out || test_failed $LINENO
+# same size, first header, and last trailer, but rewritten later
+head -c 100000 in8 > out || framework_failure
+"${LZIP}" -0 -c out > a.lz || test_failed $LINENO
+"${LZIP}" -0 -c in8 > b.lz || test_failed $LINENO
+cat b.lz a.lz b.lz > out.lz || framework_failure
+touch -t 200001010000 out.lz || framework_failure
+"${LZIP}" -l --make-index out.lz > /dev/null || test_failed $LINENO
+cat a.lz b.lz b.lz > out.lz || framework_failure
+cat out in8 in8 > copy || framework_failure
+"${LZIP}" -n4 -cd out.lz | cmp copy - || test_failed $LINENO
+rm -f a.lz b.lz out.lz out.lz.lzidx || framework_failure
+# overlap I/O with (de)compression
+"${LZIP}" -c in8 > copy || test_failed $LINENO
+"${LZIP}" --async-io -c in8 | cmp copy - || test_failed $LINENO
+cat in8 | "${LZIP}" --async-io | cmp copy - || test_failed $LINENO
+"${LZIP}" --async-io -cd copy | cmp in8 - || test_failed $LINENO
+cat copy | "${LZIP}" --async-io -d | cmp in8 - || test_failed $LINENO
+"${LZIP}" --async-io -t copy || test_failed $LINENO
+"${LZIP}" --async-io -cdq "${testdir}"/fox6_mark.lz > out
+[ $? = 2 ] || test_failed $LINENO
+# append new members to an existing file
+cp in copy || framework_failure
+"${LZIP}" -k --append -b100k copy || test_failed $LINENO
+"${LZIP}" -k --append copy || test_failed $LINENO
+"${LZIP}" -cd copy.lz > out || test_failed $LINENO
+cat in in | cmp - out || test_failed $LINENO
+"${LZIP}" -c in > out.lz || test_failed $LINENO
+"${LZIP}" -n4 -b100k --append -o out.lz in8 || test_failed $LINENO
+"${LZIP}" -cd out.lz > out || test_failed $LINENO
+cat in in8 | cmp - out || test_failed $LINENO
+cat out.lz > copy.lz || framework_failure
+printf "garbage" >> copy.lz || framework_failure
+cp copy.lz copy || framework_failure
+"${LZIP}" -q --append -o copy.lz in		# trailing data
+[ $? = 1 ] || test_failed $LINENO
+cmp copy copy.lz || test_failed $LINENO
+cat in | "${LZIP}" -q --append > out
+[ $? = 1 ] || test_failed $LINENO
+rm -f copy copy.lz || framework_failure
+# operate recursively on directories
+mkdir -p tree/a/b tree/c || framework_failure
+cp in tree/in || framework_failure
+cp in8 tree/c/in8 || framework_failure
+for i in 1 2 3 4 5 ; do
+	head -c ${i}000 in > tree/a/b/s$i || framework_failure
+done
+cp in tree/a/in.lz || framework_failure		# not a lzip file
+cp -R tree orig || framework_failure
+"${LZIP}" -q tree
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -rk -n4 tree || test_failed $LINENO
+[ -e tree/c/in8.lz ] || test_failed $LINENO
+[ -e tree/a/b/s5.lz ] || test_failed $LINENO
+[ ! -e tree/a/in.lz.lz ] || test_failed $LINENO
+"${LZIP}" -rt -n4 tree/c tree/a/b || test_failed $LINENO
+"${LZIP}" -cd tree/c/in8.lz | cmp in8 - || test_failed $LINENO
+rm -f tree/in tree/c/in8 tree/a/b/s? || framework_failure
+"${LZIP}" -qrt -n4 tree
+[ $? = 2 ] || test_failed $LINENO
+rm -f tree/a/in.lz || framework_failure
+"${LZIP}" -dr -n4 tree || test_failed $LINENO
+rm -f orig/a/in.lz || framework_failure
+diff -r orig tree > /dev/null || test_failed $LINENO
+"${LZIP}" -r tree || test_failed $LINENO
+"${LZIP}" -dr tree || test_failed $LINENO
+diff -r orig tree > /dev/null || test_failed $LINENO
+rm -rf tree orig || framework_failure
+# fit the coders in a memory limit
+"${LZIP}" -c in8 > copy || test_failed $LINENO
+"${LZIP}" --memory-limit=1Gi -c in8 | cmp copy - || test_failed $LINENO
+"${LZIP}" -9 -n4 --memory-limit=20MiB -c in8 > out.lz || test_failed $LINENO
+"${LZIP}" -cd out.lz | cmp in8 - || test_failed $LINENO
+"${LZIP}" -0 -b100k -c in8 > out.lz || test_failed $LINENO
+"${LZIP}" -n4 --memory-limit=20MiB -cd out.lz | cmp in8 - ||
+	test_failed $LINENO
+"${LZIP}" -q --memory-limit=100k -cd copy > /dev/null
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -q --memory-limit=100k -c in8 > /dev/null
+[ $? = 1 ] || test_failed $LINENO
+# write progress records to a file descriptor
+"${LZIP}" -c --progress-fd=3 in8 3> copy > out.lz || test_failed $LINENO
+size=`wc -c < out.lz | tr -d ' '`
+grep "^end mode=c member=1 .* in=290408 out=${size} .* file=in8$" copy \
+	> /dev/null || test_failed $LINENO
+"${LZIP}" -cd --progress-fd=3 out.lz 3> copy | cmp in8 - ||
+	test_failed $LINENO
+grep "^end mode=d member=1 .* in=${size} out=290408 .* percent=100 " copy \
+	> /dev/null || test_failed $LINENO
+# the multithreaded coders write records too
+"${LZIP}" -s4KiB -n2 -c --progress-fd=3 in8 3> copy > out.lz ||
+	test_failed $LINENO
+size=`wc -c < out.lz | tr -d ' '`
+grep "^end mode=c member=36 .* in=290408 out=${size} .* file=in8$" copy \
+	> /dev/null || test_failed $LINENO
+"${LZIP}" -n2 -cd --progress-fd=3 out.lz 3> copy | cmp in8 - ||
+	test_failed $LINENO
+grep "^end mode=d member=36 .* in=${size} out=290408 .* percent=100 " copy \
+	> /dev/null || test_failed $LINENO
+"${LZIP}" -n2 -t --progress-fd=3 < out.lz 3> copy || test_failed $LINENO
+grep "^end mode=d member=36 .* in=${size} out=290408 .* file=(stdin)$" copy \
+	> /dev/null || test_failed $LINENO
+"${LZIP}" -q --progress-fd=9 -c in > /dev/null 9>&-
+[ $? = 1 ] || test_failed $LINENO
+# recover the intact members of a damaged file
+cat "${in_lz}" "${testdir}"/fox_bcrc.lz "${in_lz}" > copy.lz ||
+	framework_failure
+cat "${in_lz}" > copy2.lz || framework_failure
+printf "damaged data, not a member" >> copy2.lz || framework_failure
+cat "${in_lz}" >> copy2.lz || framework_failure
+cat "${in_lz}" "${testdir}"/fox_bcrc.lz > copy3.lz || framework_failure
+printf "damaged data, not a member" >> copy3.lz || framework_failure
+cat "${in_lz}" >> copy3.lz || framework_failure
+"${LZIP}" -lq copy2.lz
+[ $? = 2 ] || test_failed $LINENO
+for i in "" -n4 ; do
+	"${LZIP}" -t --recover $i "${in_lz}" || test_failed $LINENO "$i"
+	"${LZIP}" -cd --recover $i "${in_lz}" | cmp in - ||
+		test_failed $LINENO "$i"
+	"${LZIP}" -tq --recover $i copy.lz	# index is not damaged
+	[ $? = 2 ] || test_failed $LINENO "$i"
+	"${LZIP}" -cdq --recover $i copy.lz > out
+	[ $? = 2 ] || test_failed $LINENO "$i"
+	for j in copy2.lz copy3.lz ; do
+		"${LZIP}" -tq --recover $i $j
+		[ $? = 2 ] || test_failed $LINENO "$i $j"
+		"${LZIP}" -cdq --recover $i $j > out || test_failed $LINENO "$i $j"
+		cat in in | cmp - out || test_failed $LINENO "$i $j"
+	done
+done
+"${LZIP}" -l --recover copy2.lz > out || test_failed $LINENO
+grep 72602 out > /dev/null || test_failed $LINENO
+"${LZIP}" -tq --recover in
+[ $? = 2 ] || test_failed $LINENO
+rm -f copy.lz copy2.lz copy3.lz || framework_failure
+# leave holes in the output for blocks of zeros
+dd if=/dev/zero of=copy bs=1024 count=300 2> /dev/null || framework_failure
+cat copy in8 copy > in9 || framework_failure
+"${LZIP}" -0 -b100k -c in9 > out.lz || test_failed $LINENO
+for i in "" -n4 --async-io ; do
+	rm -f out || framework_failure
+	"${LZIP}" -cd --sparse $i out.lz > out || test_failed $LINENO "$i"
+	cmp in9 out || test_failed $LINENO "$i"
+	cat out.lz | "${LZIP}" -d --sparse $i > out || test_failed $LINENO "$i"
+	cmp in9 out || test_failed $LINENO "$i"
+done
+"${LZIP}" -cd --sparse --range=200000-400000 out.lz > out ||
+	test_failed $LINENO
+tail -c +200001 in9 | head -c 200000 | cmp - out || test_failed $LINENO
+"${LZIP}" -cd --sparse out.lz | cmp in9 - || test_failed $LINENO
+"${LZIP}" -t --sparse out.lz || test_failed $LINENO
+rm -f in9 || framework_failure
+# choose the level from a sample of the input
+"${LZIP}" -0 -c in8 > copy || test_failed $LINENO
+"${LZIP}" --auto=speed:1e9MB/s -c in8 | cmp copy - || test_failed $LINENO
+cat in8 | "${LZIP}" --auto=speed:1e9 | cmp copy - || test_failed $LINENO
+cat in8 | "${LZIP}" -n2 --auto=ratio:1 | cmp copy - || test_failed $LINENO
+"${LZIP}" --auto=ratio:1e9:1 -c in8 | "${LZIP}" -d | cmp in8 - ||
+	test_failed $LINENO
+"${LZIP}" -q --auto=speed:0 -c in8 > /dev/null
+[ $? = 1 ] || test_failed $LINENO
+"${LZIP}" -q --auto=fast -c in8 > /dev/null
+[ $? = 1 ] || test_failed $LINENO
+# a sample compressed to more than its size must not be split in members
+head -c 40 in > out || framework_failure
+"${LZIP}" -0 -c out > copy || test_failed $LINENO
+"${LZIP}" --auto=ratio:0.5 -c out | cmp copy - || test_failed $LINENO
+# incompressible data coded as literals, with the high bits of a
+# Park-Miller generator written as octal escapes
+awk 'BEGIN { x = 1
+  for( i = 0; i < 300000; ++i ) {
+    x = ( x * 16807 ) % 2147483647 ; printf "\\%o", int( x / 8388608 )
+    if( i % 512 == 511 ) printf "\n" }
+  printf "\n" }' | unescape > copy || framework_failure
+size=`wc -c < copy | tr -d ' '`
+[ "${size}" = 300000 ] || framework_failure
+# literals cost a bit more than a byte each; allow 2 percent
+for i in -0 --fast=3 -6 ; do
+	size=`"${LZIP}" $i -c copy | wc -c | tr -d ' '`
+	[ "${size}" -le 306000 ] || test_failed $LINENO "$i ${size}"
+done
+cat copy in8 copy > out || framework_failure
+"${LZIP}" -b100k -c out | "${LZIP}" -d | cmp out - || test_failed $LINENO
+"${LZIP}" -c out | "${LZIP}" -d | cmp out - || test_failed $LINENO
+# statistics, if compiled in
+if "${LZIP}" --stats -c in > out.lz 2> out ; then
+	[ -s out ] || test_failed $LINENO
+	"${LZIP}" -cd out.lz | cmp in - || test_failed $LINENO
+fi
+rm -f copy out || framework_failure
+# compress the rest of a regular file already partially read
+{ dd bs=100 count=1 > /dev/null 2>&1 ; "${LZIP}" -c ; } < in > out.lz ||
+	test_failed $LINENO
+tail -c +101 in | "${LZIP}" | cmp out.lz - || test_failed $LINENO
+"${LZIP}" -n4 -c in > out.lz || test_failed $LINENO	# one block
+"${LZIP}" -c in | cmp out.lz - || test_failed $LINENO
+rm -f in8 in8.lz out.lz || framework_failure
 
 "${LZIP}" fox -o a/b/c/fox.lz || test_failed $LINENO
 cmp "${fox_lz}" a/b/c/fox.lz || test_failed $LINENO